@@ -28,6 +28,9 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
     sierra-ril.c \
     atchannel.c \
+    at_framer.c \
+    at_cmd.c \
+    at_cmux.c \
     misc.c \
     at_tok.c
 
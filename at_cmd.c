@@ -0,0 +1,110 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#include "at_cmd.h"
+#include <string.h>
+
+static void appendBytes(ATCmd *p_cmd, const char *s, size_t len)
+{
+    // keep room for the NUL; an overflow sticks until at_cmd_end()
+    if (len >= p_cmd->size - p_cmd->length) {
+        p_cmd->length = p_cmd->size;
+        return;
+    }
+
+    memcpy(p_cmd->buf + p_cmd->length, s, len);
+    p_cmd->length += len;
+}
+
+static void separate(ATCmd *p_cmd)
+{
+    if (p_cmd->params++ > 0) {
+        appendBytes(p_cmd, ",", 1);
+    }
+}
+
+void at_cmd_start(ATCmd *p_cmd, char *buf, size_t size, const char *name)
+{
+    p_cmd->buf = buf;
+    p_cmd->size = size;
+    p_cmd->length = 0;
+    p_cmd->params = 0;
+
+    at_cmd_append(p_cmd, name);
+}
+
+/** appends s as is, without a separator; NULL appends nothing */
+void at_cmd_append(ATCmd *p_cmd, const char *s)
+{
+    if (s != NULL) {
+        appendBytes(p_cmd, s, strlen(s));
+    }
+}
+
+/** appends a decimal integer parameter */
+void at_cmd_int(ATCmd *p_cmd, int value)
+{
+    char digits[12];
+    char *p = digits + sizeof(digits);
+    unsigned int u = (value < 0) ? 0u - (unsigned int) value : (unsigned int) value;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    separate(p_cmd);
+    appendBytes(p_cmd, p, digits + sizeof(digits) - p);
+}
+
+/** appends an unquoted string parameter */
+void at_cmd_param(ATCmd *p_cmd, const char *s)
+{
+    separate(p_cmd);
+    at_cmd_append(p_cmd, s);
+}
+
+/** appends a string parameter in double quotes */
+void at_cmd_quoted(ATCmd *p_cmd, const char *s)
+{
+    separate(p_cmd);
+    appendBytes(p_cmd, "\"", 1);
+    at_cmd_append(p_cmd, s);
+    appendBytes(p_cmd, "\"", 1);
+}
+
+/**
+ * NUL terminates the command
+ * returns the command, or NULL if it did not fit the buffer
+ */
+const char *at_cmd_end(ATCmd *p_cmd)
+{
+    if (p_cmd->length >= p_cmd->size) {
+        return NULL;
+    }
+
+    p_cmd->buf[p_cmd->length] = '\0';
+
+    return p_cmd->buf;
+}
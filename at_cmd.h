@@ -0,0 +1,60 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#ifndef AT_CMD_H
+#define AT_CMD_H 1
+
+#include <stddef.h>
+
+/* fits AT+CRSM with 255 bytes of data as hex */
+#define AT_CMD_MAX 600
+
+/**
+ * Builds an AT command line into a caller supplied buffer
+ *
+ * at_cmd_start() writes the command name, up to and including any '='.
+ * Each parameter appended after that is preceded by a ',' unless it is
+ * the first; at_cmd_append() adds text with no separator. A command that
+ * does not fit is caught by at_cmd_end(), so the appends need no checks.
+ *
+ *   char buf[AT_CMD_MAX];
+ *   ATCmd cmd;
+ *
+ *   at_cmd_start(&cmd, buf, sizeof(buf), "AT+CMGW=");
+ *   at_cmd_int(&cmd, length);
+ *   at_cmd_int(&cmd, status);
+ *
+ *   err = at_send_command(at_cmd_end(&cmd), NULL);
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t length;      /* size once the command has overflowed */
+    int params;
+} ATCmd;
+
+void at_cmd_start(ATCmd *p_cmd, char *buf, size_t size, const char *name);
+void at_cmd_append(ATCmd *p_cmd, const char *s);
+void at_cmd_int(ATCmd *p_cmd, int value);
+void at_cmd_param(ATCmd *p_cmd, const char *s);
+void at_cmd_quoted(ATCmd *p_cmd, const char *s);
+const char *at_cmd_end(ATCmd *p_cmd);
+
+#endif /*AT_CMD_H*/
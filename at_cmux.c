@@ -0,0 +1,821 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#include "at_cmux.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+/* TS 27.010 basic option framing */
+#define CMUX_FLAG 0xF9
+#define CMUX_EA 0x01
+#define CMUX_CR 0x02
+#define CMUX_PF 0x10
+
+#define CMUX_SABM 0x2F
+#define CMUX_UA 0x63
+#define CMUX_DM 0x0F
+#define CMUX_DISC 0x43
+#define CMUX_UIH 0xEF
+
+/* DLC0 control messages, type octet with EA set */
+#define CMUX_MSG_CLD 0xC1
+#define CMUX_MSG_TEST 0x21
+#define CMUX_MSG_MSC 0xE1
+
+/* MSC V.24 signals: flow control (stop sending), ready to
+   communicate, ready to receive, data valid */
+#define CMUX_V24_FC 0x02
+#define CMUX_V24_RTC 0x04
+#define CMUX_V24_RTR 0x08
+#define CMUX_V24_DV 0x80
+
+/* default N1 for AT+CMUX=0 */
+#define CMUX_MAX_INFO 31
+#define CMUX_RX_SIZE 4096
+#define CMUX_DLC_BUF_SIZE 4096
+#define CMUX_OPEN_TIMEOUT_MSEC 3000
+#define MAX_EPOLL_EVENTS (CMUX_MAX_DLC + 2)
+
+static pthread_t s_tid_mux;
+static int s_muxRunning = 0;
+static int s_ttyfd = -1;
+static int s_wakefd = -1;
+static int s_epfd = -1;
+static int s_dlcCount = 0;
+
+/* our ends of the socket pairs, s_dlcfds[i] is DLC i + 1 */
+static int s_dlcfds[CMUX_MAX_DLC];
+
+/*
+ * data from the modem the AT channel has not read yet, per DLC. The mux
+ * thread never blocks on one DLC socket: what does not fit is kept here
+ * until the socket is writable, the modem is asked to stop sending on
+ * that DLC once half of it is used, and anything beyond it is dropped
+ */
+static struct {
+    unsigned char buf[CMUX_DLC_BUF_SIZE];
+    size_t len;
+    size_t dropped;
+    int throttled;
+} s_dlcPending[CMUX_MAX_DLC];
+
+/* frames read from the tty that are not complete yet */
+static unsigned char s_rxBuf[CMUX_RX_SIZE + 1]; /* + 1 for AT+CMUX's '\0' */
+static size_t s_rxLen = 0;
+
+/* TS 27.010 5.2.1.6, reversed CRC-8 with polynomial x^8+x^2+x+1 */
+static const unsigned char s_crcTable[256] = {
+    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+    0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+    0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+    0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+    0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+    0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+    0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+    0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+    0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+    0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+    0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+    0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+    0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+    0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+    0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+    0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+    0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF
+};
+
+static unsigned char crc8(const unsigned char *p, size_t len)
+{
+    unsigned char crc = 0xFF;
+
+    while (len-- > 0) {
+        crc = s_crcTable[crc ^ *p++];
+    }
+
+    return crc;
+}
+
+/** writes all of buf to fd, which may be blocking */
+static int writeAll(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        do {
+            written = write(fd, buf, len);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            LOGE("cmux: write failed %s", strerror(errno));
+            return -1;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * sends one basic option frame; info may be NULL when len is 0
+ * len must not exceed CMUX_MAX_INFO
+ */
+static int writeFrame(int dlci, unsigned char control,
+                        const unsigned char *info, size_t len)
+{
+    unsigned char frame[CMUX_MAX_INFO + 6];
+    size_t n = 0;
+
+    frame[n++] = CMUX_FLAG;
+    /* we are the initiator, so our commands carry C/R */
+    frame[n++] = (dlci << 2) | CMUX_CR | CMUX_EA;
+    frame[n++] = control;
+    frame[n++] = (len << 1) | CMUX_EA;
+
+    if (len > 0) {
+        memcpy(frame + n, info, len);
+    }
+
+    /* UIH frames are checked over the header only */
+    frame[n + len] = 0xFF - crc8(frame + 1, 3);
+    n += len + 1;
+    frame[n++] = CMUX_FLAG;
+
+    return writeAll(s_ttyfd, frame, n);
+}
+
+/** sends a control message on DLC0 */
+static int writeControl(unsigned char type, const unsigned char *value,
+                        size_t len)
+{
+    unsigned char msg[CMUX_MAX_INFO];
+
+    msg[0] = type | CMUX_CR;
+    msg[1] = (len << 1) | CMUX_EA;
+
+    if (len > 0) {
+        memcpy(msg + 2, value, len);
+    }
+
+    return writeFrame(0, CMUX_UIH, msg, len + 2);
+}
+
+/**
+ * Reads more of the tty into s_rxBuf, waiting up to timeoutMsec
+ * (-1 for no limit). returns the number of bytes read, 0 on timeout
+ * and -1 on EOF or error
+ */
+static int readTty(int timeoutMsec)
+{
+    struct pollfd pfd;
+    ssize_t count;
+    int ret;
+
+    pfd.fd = s_ttyfd;
+    pfd.events = POLLIN;
+
+    if (timeoutMsec >= 0) {
+        do {
+            ret = poll(&pfd, 1, timeoutMsec);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    if (s_rxLen == CMUX_RX_SIZE) {
+        /* nothing in there parses; resynchronize */
+        s_rxLen = 0;
+    }
+
+    do {
+        count = read(s_ttyfd, s_rxBuf + s_rxLen, CMUX_RX_SIZE - s_rxLen);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        return -1;
+    }
+
+    s_rxLen += count;
+
+    return count;
+}
+
+/**
+ * Finds the next complete frame in s_rxBuf. *p_consumed is set to the
+ * number of bytes to hand to consumeRx() once the frame has been used,
+ * which includes garbage before a flag and frames with a bad FCS.
+ * returns 1 with *p_dlci, *p_control, *pp_info and *p_len set, 0 if
+ * more input is needed
+ */
+static int nextFrame(size_t *p_consumed, int *p_dlci,
+                    unsigned char *p_control,
+                    const unsigned char **pp_info, size_t *p_len)
+{
+    unsigned char *p;
+    size_t start = 0;
+    size_t hdr, len;
+
+    for (;;) {
+        /* find the opening flag, skipping repeated ones */
+        while (start < s_rxLen && s_rxBuf[start] != CMUX_FLAG) {
+            start++;
+        }
+        while (start + 1 < s_rxLen && s_rxBuf[start + 1] == CMUX_FLAG) {
+            start++;
+        }
+
+        *p_consumed = start;
+
+        if (s_rxLen - start < 6) {
+            return 0;
+        }
+
+        p = s_rxBuf + start + 1;
+
+        if (p[2] & CMUX_EA) {
+            len = p[2] >> 1;
+            hdr = 3;
+        } else {
+            len = (p[2] >> 1) | (p[3] << 7);
+            hdr = 4;
+        }
+
+        if (len > CMUX_RX_SIZE - 8) {
+            /* cannot be a frame */
+            start++;
+            continue;
+        }
+
+        if (s_rxLen - start < 1 + hdr + len + 2) {
+            return 0;
+        }
+
+        if (p[hdr + len + 1] != CMUX_FLAG
+            || s_crcTable[crc8(p, hdr) ^ p[hdr + len]] != 0xCF
+        ) {
+            LOGE("cmux: dropping bad frame");
+            start++;
+            continue;
+        }
+
+        *p_dlci = p[0] >> 2;
+        *p_control = p[1] & ~CMUX_PF;
+        *pp_info = p + hdr;
+        *p_len = len;
+        /* the closing flag may open the next frame */
+        *p_consumed = start + 1 + hdr + len + 1;
+
+        return 1;
+    }
+}
+
+static void consumeRx(size_t consumed)
+{
+    s_rxLen -= consumed;
+    memmove(s_rxBuf, s_rxBuf + consumed, s_rxLen);
+}
+
+/**
+ * Waits for the UA (or DM) answering a SABM on dlci, discarding
+ * anything else. returns 0 on UA, -1 otherwise
+ */
+static int waitForUA(int dlci)
+{
+    const unsigned char *info;
+    unsigned char control;
+    size_t consumed, len;
+    int frameDlci;
+    int found;
+
+    for (;;) {
+        found = nextFrame(&consumed, &frameDlci, &control, &info, &len);
+        consumeRx(consumed);
+
+        if (found && frameDlci == dlci) {
+            if (control == CMUX_UA) {
+                return 0;
+            } else if (control == CMUX_DM) {
+                LOGE("cmux: DLC %d refused", dlci);
+                return -1;
+            }
+        }
+
+        if (!found && readTty(CMUX_OPEN_TIMEOUT_MSEC) <= 0) {
+            LOGE("cmux: no answer opening DLC %d", dlci);
+            return -1;
+        }
+    }
+}
+
+/** sends our V.24 state for dlci, with flow control set if stop */
+static int writeMsc(int dlci, int stop)
+{
+    unsigned char msc[2];
+
+    msc[0] = (dlci << 2) | CMUX_CR | CMUX_EA;
+    msc[1] = CMUX_V24_RTC | CMUX_V24_RTR | CMUX_V24_DV | CMUX_EA;
+
+    if (stop) {
+        msc[1] |= CMUX_V24_FC;
+    }
+
+    return writeControl(CMUX_MSG_MSC, msc, sizeof(msc));
+}
+
+static int openDlc(int dlci)
+{
+    if (writeFrame(dlci, CMUX_SABM | CMUX_PF, NULL, 0) < 0
+        || waitForUA(dlci) < 0
+    ) {
+        return -1;
+    }
+
+    if (dlci == 0) {
+        return 0;
+    }
+
+    /* some modems hold back data until they have seen the V.24 state */
+    return writeMsc(dlci, 0);
+}
+
+/**
+ * Sends AT+CMUX=0 and waits for its final response
+ * returns 0 on OK, -1 otherwise
+ */
+static int startMux()
+{
+    static const char cmd[] = "AT+CMUX=0\r";
+    char *p_line;
+
+    s_rxLen = 0;
+
+    if (writeAll(s_ttyfd, (const unsigned char *) cmd, strlen(cmd)) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        if (readTty(CMUX_OPEN_TIMEOUT_MSEC) <= 0) {
+            LOGE("cmux: no answer to AT+CMUX");
+            return -1;
+        }
+
+        s_rxBuf[s_rxLen] = '\0';
+        p_line = (char *) s_rxBuf;
+
+        if (strstr(p_line, "\r\nOK\r\n") != NULL) {
+            break;
+        } else if (strstr(p_line, "ERROR") != NULL) {
+            LOGE("cmux: modem refused AT+CMUX");
+            return -1;
+        }
+    }
+
+    /* the modem is in basic mode now; nothing after OK is ours */
+    s_rxLen = 0;
+
+    return 0;
+}
+
+/** handles a control message the modem sent on DLC0 */
+static int processControl(const unsigned char *info, size_t len)
+{
+    unsigned char reply[CMUX_MAX_INFO];
+    size_t valueLen;
+
+    if (len < 2) {
+        return 0;
+    }
+
+    valueLen = info[1] >> 1;
+
+    if (valueLen + 2 > len) {
+        return 0;
+    }
+
+    if (!(info[0] & CMUX_CR)) {
+        /* a response to one of ours */
+        return 0;
+    }
+
+    switch (info[0] & ~CMUX_CR) {
+        case CMUX_MSG_CLD:
+            LOGI("cmux: modem closed the multiplexer");
+            return -1;
+
+        case CMUX_MSG_MSC:
+        case CMUX_MSG_TEST:
+            /* echo it back as the response */
+            if (len > sizeof(reply)) {
+                return 0;
+            }
+            memcpy(reply, info, len);
+            reply[0] &= ~CMUX_CR;
+            writeFrame(0, CMUX_UIH, reply, len);
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+static void setDlcEvents(int index, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = s_dlcfds[index];
+
+    epoll_ctl(s_epfd, EPOLL_CTL_MOD, s_dlcfds[index], &ev);
+}
+
+/**
+ * hands data from the modem to the AT channel of DLC index + 1,
+ * keeping in s_dlcPending what its socket does not take now
+ */
+static void deliverDlc(int index, const unsigned char *info, size_t len)
+{
+    ssize_t sent = 0;
+    size_t room;
+
+    if (s_dlcPending[index].len == 0) {
+        do {
+            sent = send(s_dlcfds[index], info, len, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            /* the other end may already be closed by at_close() */
+            return;
+        }
+
+        if (sent < 0) {
+            sent = 0;
+        }
+
+        if ((size_t) sent == len) {
+            return;
+        }
+
+        setDlcEvents(index, EPOLLIN | EPOLLOUT);
+    }
+
+    info += sent;
+    len -= sent;
+    room = CMUX_DLC_BUF_SIZE - s_dlcPending[index].len;
+
+    if (len > room) {
+        s_dlcPending[index].dropped += len - room;
+        len = room;
+    }
+
+    memcpy(s_dlcPending[index].buf + s_dlcPending[index].len, info, len);
+    s_dlcPending[index].len += len;
+
+    if (!s_dlcPending[index].throttled
+        && s_dlcPending[index].len >= CMUX_DLC_BUF_SIZE / 2
+    ) {
+        s_dlcPending[index].throttled = 1;
+        writeMsc(index + 1, 1);
+    }
+}
+
+/** sends what is pending for DLC index + 1 once its socket is writable */
+static void flushDlc(int index)
+{
+    ssize_t sent;
+
+    do {
+        sent = send(s_dlcfds[index], s_dlcPending[index].buf,
+                    s_dlcPending[index].len, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    if (sent < 0) {
+        /* closed by at_close(); nobody wants it any more */
+        sent = s_dlcPending[index].len;
+    }
+
+    s_dlcPending[index].len -= sent;
+    memmove(s_dlcPending[index].buf, s_dlcPending[index].buf + sent,
+            s_dlcPending[index].len);
+
+    if (s_dlcPending[index].len > 0) {
+        return;
+    }
+
+    setDlcEvents(index, EPOLLIN);
+
+    if (s_dlcPending[index].dropped > 0) {
+        LOGE("cmux: DLC %d was not read, dropped %d bytes",
+                index + 1, (int) s_dlcPending[index].dropped);
+        s_dlcPending[index].dropped = 0;
+    }
+
+    if (s_dlcPending[index].throttled) {
+        s_dlcPending[index].throttled = 0;
+        writeMsc(index + 1, 0);
+    }
+}
+
+/**
+ * demultiplexes every complete frame in s_rxBuf
+ * returns -1 once the multiplexer has been closed by the modem
+ */
+static int processFrames()
+{
+    const unsigned char *info;
+    unsigned char control;
+    size_t consumed, len;
+    int dlci;
+    int ret = 0;
+
+    while (ret == 0
+            && nextFrame(&consumed, &dlci, &control, &info, &len)) {
+        if (dlci == 0 && control == CMUX_UIH) {
+            ret = processControl(info, len);
+        } else if (dlci == 0 && control == CMUX_DISC) {
+            ret = -1;
+        } else if (dlci >= 1 && dlci <= s_dlcCount) {
+            if (control == CMUX_UIH) {
+                deliverDlc(dlci - 1, info, len);
+            } else if (control == CMUX_DISC || control == CMUX_DM) {
+                LOGE("cmux: modem closed DLC %d", dlci);
+                ret = -1;
+            }
+        }
+
+        consumeRx(consumed);
+    }
+
+    return ret;
+}
+
+/** sends what the AT channel wrote to a DLC socket */
+static int forwardDlc(int index)
+{
+    unsigned char buf[CMUX_MAX_INFO];
+    ssize_t count;
+
+    do {
+        count = read(s_dlcfds[index], buf, sizeof(buf));
+    } while (count < 0 && errno == EINTR);
+
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    if (count <= 0) {
+        /* at_close() has let go of it */
+        return -1;
+    }
+
+    return writeFrame(index + 1, CMUX_UIH, buf, count);
+}
+
+static void *muxLoop(void *arg)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int n, i;
+
+    for (;;) {
+        do {
+            n = epoll_wait(s_epfd, events, MAX_EPOLL_EVENTS, -1);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            LOGE("cmux: epoll_wait failed %s", strerror(errno));
+            goto out;
+        }
+
+        for (i = 0 ; i < n ; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == s_wakefd) {
+                /* cmux_close() was called */
+                goto out;
+            } else if (fd == s_ttyfd) {
+                if (readTty(-1) < 0 || processFrames() < 0) {
+                    goto out;
+                }
+            } else if (fd >= 0) {
+                int j;
+
+                for (j = 0 ; j < s_dlcCount ; j++) {
+                    if (s_dlcfds[j] != fd) {
+                        continue;
+                    }
+
+                    if (events[i].events & EPOLLOUT) {
+                        flushDlc(j);
+                    }
+
+                    if ((events[i].events & ~EPOLLOUT)
+                        && forwardDlc(j) < 0
+                    ) {
+                        goto out;
+                    }
+                }
+            }
+        }
+    }
+
+out:
+    /* atchannel sees EOF on every DLC and reports the channel closed */
+    for (i = 0 ; i < s_dlcCount ; i++) {
+        shutdown(s_dlcfds[i], SHUT_RDWR);
+    }
+
+    return NULL;
+}
+
+static int addEpollFd(int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    return epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void closeMuxFds()
+{
+    int i;
+
+    for (i = 0 ; i < s_dlcCount ; i++) {
+        close(s_dlcfds[i]);
+        s_dlcfds[i] = -1;
+    }
+    s_dlcCount = 0;
+
+    if (s_epfd >= 0) {
+        close(s_epfd);
+        s_epfd = -1;
+    }
+
+    if (s_wakefd >= 0) {
+        close(s_wakefd);
+        s_wakefd = -1;
+    }
+}
+
+int cmux_open(int fd, int count, int *fds)
+{
+    int sv[2];
+    int i;
+    int started = 0;
+    pthread_attr_t attr;
+
+    if (s_muxRunning || count < 1 || count > CMUX_MAX_DLC) {
+        return -1;
+    }
+
+    s_ttyfd = fd;
+    s_dlcCount = 0;
+
+    if (startMux() < 0) {
+        goto error;
+    }
+
+    started = 1;
+
+    if (openDlc(0) < 0) {
+        goto error;
+    }
+
+    s_wakefd = eventfd(0, EFD_NONBLOCK);
+    s_epfd = epoll_create(MAX_EPOLL_EVENTS);
+
+    if (s_wakefd < 0 || s_epfd < 0
+        || addEpollFd(s_ttyfd) < 0 || addEpollFd(s_wakefd) < 0
+    ) {
+        LOGE("cmux: unable to set up mux thread %s", strerror(errno));
+        goto error;
+    }
+
+    for (i = 0 ; i < count ; i++) {
+        if (openDlc(i + 1) < 0) {
+            goto error;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            LOGE("cmux: socketpair failed %s", strerror(errno));
+            goto error;
+        }
+
+        fds[i] = sv[0];
+        s_dlcfds[i] = sv[1];
+        s_dlcPending[i].len = 0;
+        s_dlcPending[i].dropped = 0;
+        s_dlcPending[i].throttled = 0;
+        s_dlcCount++;
+
+        if (fcntl(sv[1], F_SETFL, O_NONBLOCK) < 0 || addEpollFd(sv[1]) < 0) {
+            goto error;
+        }
+    }
+
+    /* frames that came in while opening the DLCs */
+    if (processFrames() < 0) {
+        goto error;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    if (pthread_create(&s_tid_mux, &attr, muxLoop, NULL) < 0) {
+        perror ("pthread_create");
+        goto error;
+    }
+
+    s_muxRunning = 1;
+
+    return 0;
+
+error:
+    if (started) {
+        /* the modem is in basic mode; take it back to AT mode so the
+           caller can fall back to plain AT on the tty */
+        writeControl(CMUX_MSG_CLD, NULL, 0);
+    }
+
+    for (i = 0 ; i < s_dlcCount ; i++) {
+        close(fds[i]);
+    }
+    closeMuxFds();
+    s_ttyfd = -1;
+
+    return -1;
+}
+
+void cmux_close()
+{
+    uint64_t one = 1;
+
+    if (!s_muxRunning) {
+        return;
+    }
+
+    write(s_wakefd, &one, sizeof(one));
+    pthread_join(s_tid_mux, NULL);
+    s_muxRunning = 0;
+
+    /* back to AT mode; harmless if the modem already left basic mode */
+    writeControl(CMUX_MSG_CLD, NULL, 0);
+
+    closeMuxFds();
+    s_ttyfd = -1;
+}
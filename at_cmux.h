@@ -0,0 +1,50 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+
+#ifndef AT_CMUX_H
+#define AT_CMUX_H 1
+
+/* DLCs that can be opened besides the DLC0 control channel */
+#define CMUX_MAX_DLC 4
+
+/**
+ * Switches the modem on fd into 3GPP TS 27.010 basic mode with
+ * AT+CMUX=0 and opens DLC 1 to count. fds[i] is set to a socket
+ * carrying the AT stream of DLC i + 1, ready to be given to at_open()
+ * or at_add_channel(). A thread moves data between those sockets and fd
+ * until the modem drops the multiplexer or cmux_close() is called.
+ * A DLC whose socket is not read does not hold up the others: the modem
+ * is asked to stop sending on it, and what still arrives past a buffer
+ * is dropped.
+ *
+ * fd must stay open until cmux_close() returns
+ * returns 0 on success, -1 on error
+ */
+int cmux_open(int fd, int count, int *fds);
+
+/**
+ * Stops the multiplexer thread and sends the close down command that
+ * returns the modem to AT mode. The DLC sockets given out by
+ * cmux_open() read EOF if they are still open
+ */
+void cmux_close();
+
+#endif /*AT_CMUX_H*/
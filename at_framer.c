@@ -0,0 +1,330 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#include "at_framer.h"
+#include "atchannel.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#define HAVE_SSE2_FRAMING 1
+#include <emmintrin.h>
+#endif
+
+/* needs the target attribute, gcc 4.9 or clang */
+#if defined(__x86_64__) && (defined(__clang__) \
+    || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_AVX2_FRAMING 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_FRAMING 1
+#include <arm_neon.h>
+#endif
+
+#define LOG_NDEBUG 0
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+#define RING_MASK (AT_FRAMER_SIZE - 1)
+
+/*
+ * A scan function returns the index of the first of the len bytes at p
+ * that is a line terminator ('\r' or '\n') if match is set, or that is
+ * not one if match is clear; len if there is none. The vector versions
+ * test 16 or 32 bytes at a time and leave the remainder to scanScalar()
+ */
+typedef size_t (*ScanFunc)(const char *p, size_t len, int match);
+
+static size_t scanScalar(const char *p, size_t len, int match)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i++) {
+        if ((p[i] == '\r' || p[i] == '\n') == match) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#ifdef HAVE_SSE2_FRAMING
+static size_t scanSse2(const char *p, size_t len, int match)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    unsigned int flip = match ? 0 : 0xffff;
+    unsigned int mask;
+    __m128i v;
+    size_t i;
+
+    for (i = 0 ; i + 16 <= len ; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                _mm_cmpeq_epi8(v, lf)));
+        mask ^= flip;
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scanScalar(p + i, len - i, match);
+}
+#endif /*HAVE_SSE2_FRAMING*/
+
+#ifdef HAVE_AVX2_FRAMING
+__attribute__((target("avx2")))
+static size_t scanAvx2(const char *p, size_t len, int match)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    uint32_t flip = match ? 0 : 0xffffffff;
+    uint32_t mask;
+    __m256i v;
+    size_t i;
+
+    for (i = 0 ; i + 32 <= len ; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+        mask = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        mask ^= flip;
+
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scanSse2(p + i, len - i, match);
+}
+#endif /*HAVE_AVX2_FRAMING*/
+
+#ifdef HAVE_NEON_FRAMING
+static size_t scanNeon(const char *p, size_t len, int match)
+{
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    uint8x16_t v, hits;
+    uint64_t lo, hi;
+    size_t i;
+
+    for (i = 0 ; i + 16 <= len ; i += 16) {
+        v = vld1q_u8((const uint8_t *) (p + i));
+        hits = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+
+        if (!match) {
+            hits = vmvnq_u8(hits);
+        }
+
+        /* no movemask; each matching byte is 0xff in one of the halves */
+        lo = vgetq_lane_u64(vreinterpretq_u64_u8(hits), 0);
+        hi = vgetq_lane_u64(vreinterpretq_u64_u8(hits), 1);
+
+        if (lo != 0) {
+            return i + __builtin_ctzll(lo) / 8;
+        } else if (hi != 0) {
+            return i + 8 + __builtin_ctzll(hi) / 8;
+        }
+    }
+
+    return i + scanScalar(p + i, len - i, match);
+}
+#endif /*HAVE_NEON_FRAMING*/
+
+static ScanFunc s_scan = scanScalar;
+static pthread_once_t s_scanOnce = PTHREAD_ONCE_INIT;
+
+/** picks the widest scan the CPU supports */
+static void selectScan()
+{
+#if defined(HAVE_AVX2_FRAMING)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        s_scan = scanAvx2;
+        return;
+    }
+#endif
+
+#if defined(HAVE_SSE2_FRAMING)
+    s_scan = scanSse2;
+#elif defined(HAVE_NEON_FRAMING)
+    s_scan = scanNeon;
+#endif
+}
+
+/**
+ * returns the first index in [from, to) of the ring holding a byte
+ * that is (match) or is not (!match) a line terminator, or to
+ */
+static unsigned int scanRing(ATFramer *p_framer, unsigned int from,
+                                unsigned int to, int match)
+{
+    unsigned int offset;
+    size_t chunk, found;
+
+    while (from != to) {
+        /* the range may wrap around the end of the ring */
+        offset = from & RING_MASK;
+        chunk = to - from;
+
+        if (chunk > AT_FRAMER_SIZE - offset) {
+            chunk = AT_FRAMER_SIZE - offset;
+        }
+
+        found = s_scan(p_framer->ring + offset, chunk, match);
+        from += found;
+
+        if (found < chunk) {
+            break;
+        }
+    }
+
+    return from;
+}
+
+void at_framer_init(ATFramer *p_framer)
+{
+    pthread_once(&s_scanOnce, selectScan);
+
+    p_framer->head = 0;
+    p_framer->scan = 0;
+    p_framer->tail = 0;
+}
+
+int at_framer_read(ATFramer *p_framer, int fd)
+{
+    struct iovec iov[2];
+    unsigned int space;
+    unsigned int offset;
+    int iovcnt;
+    ssize_t count;
+
+    space = AT_FRAMER_SIZE - (p_framer->tail - p_framer->head);
+
+    if (space == 0) {
+        LOGE("ERROR: Input line exceeded buffer\n");
+        /* ditch buffer and start over again */
+        p_framer->head = p_framer->scan = p_framer->tail;
+        space = AT_FRAMER_SIZE;
+    }
+
+    /* the free space may wrap around the end of the ring */
+    offset = p_framer->tail & RING_MASK;
+
+    iov[0].iov_base = p_framer->ring + offset;
+    if (offset + space <= AT_FRAMER_SIZE) {
+        iov[0].iov_len = space;
+        iovcnt = 1;
+    } else {
+        iov[0].iov_len = AT_FRAMER_SIZE - offset;
+        iov[1].iov_base = p_framer->ring;
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    do {
+        count = readv(fd, iov, iovcnt);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        if ((size_t) count <= iov[0].iov_len) {
+            AT_DUMP( "<< ", iov[0].iov_base, count );
+        } else {
+            AT_DUMP( "<< ", iov[0].iov_base, iov[0].iov_len );
+            AT_DUMP( "<< ", p_framer->ring, count - iov[0].iov_len );
+        }
+
+        p_framer->tail += count;
+        return count;
+    }
+
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    /* read error encountered or EOF reached */
+    if(count == 0) {
+        LOGD("atchannel: EOF reached");
+    } else {
+        LOGD("atchannel: read error %s", strerror(errno));
+    }
+    return -1;
+}
+
+const char *at_framer_next_line(ATFramer *p_framer)
+{
+    unsigned int eol;
+    unsigned int start;
+    unsigned int len;
+
+    // skip over leading newlines
+    p_framer->head = scanRing(p_framer, p_framer->head, p_framer->tail, 0);
+
+    if (p_framer->scan - p_framer->head > p_framer->tail - p_framer->head) {
+        /* scan fell behind head */
+        p_framer->scan = p_framer->head;
+    }
+
+    if (p_framer->tail - p_framer->head == 2
+        && p_framer->ring[p_framer->head & RING_MASK] == '>'
+        && p_framer->ring[(p_framer->head + 1) & RING_MASK] == ' '
+    ) {
+        /* SMS prompt character...not \r terminated */
+        p_framer->head += 2;
+        p_framer->scan = p_framer->head;
+        return "> ";
+    }
+
+    // Find next newline
+    eol = scanRing(p_framer, p_framer->scan, p_framer->tail, 1);
+
+    if (eol == p_framer->tail) {
+        /* a partial line; remember how far we got */
+        p_framer->scan = eol;
+        return NULL;
+    }
+
+    start = p_framer->head & RING_MASK;
+    len = eol - p_framer->head;
+
+    p_framer->head = eol + 1;
+    p_framer->scan = p_framer->head;
+
+    if (start + len < AT_FRAMER_SIZE) {
+        /* contiguous: place a \0 over the \r and hand out the ring */
+        p_framer->ring[start + len] = '\0';
+        return p_framer->ring + start;
+    }
+
+    /* the line wraps around the end of the ring */
+    memcpy(p_framer->line, p_framer->ring + start, AT_FRAMER_SIZE - start);
+    memcpy(p_framer->line + AT_FRAMER_SIZE - start, p_framer->ring,
+            len - (AT_FRAMER_SIZE - start));
+    p_framer->line[len] = '\0';
+
+    return p_framer->line;
+}
@@ -0,0 +1,62 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#ifndef AT_FRAMER_H
+#define AT_FRAMER_H 1
+
+/* must be a power of two */
+#define AT_FRAMER_SIZE (8 * 1024)
+
+/**
+ * Splits the byte stream of an AT channel into lines
+ *
+ * Input is kept in a ring buffer. head, scan and tail are free running
+ * indices: [head, tail) is unconsumed input and [head, scan) is known
+ * not to contain a line terminator, so every byte is searched only once
+ * no matter how the input is fragmented.
+ */
+typedef struct {
+    unsigned int head;
+    unsigned int scan;
+    unsigned int tail;
+    char ring[AT_FRAMER_SIZE];
+    char line[AT_FRAMER_SIZE + 1]; /* lines that wrap around the ring */
+} ATFramer;
+
+void at_framer_init(ATFramer *p_framer);
+
+/**
+ * Reads whatever is available on fd into the framer
+ * returns the number of bytes read, 0 if the read would block
+ * and -1 on EOF or error
+ */
+int at_framer_read(ATFramer *p_framer, int fd);
+
+/**
+ * Returns the next complete line, without its terminator, or NULL if
+ * more input is needed. Special-cases the "> " SMS prompt, which is not
+ * \r terminated.
+ *
+ * The line is valid until the next call to at_framer_next_line()
+ * or at_framer_read()
+ */
+const char *at_framer_next_line(ATFramer *p_framer);
+
+#endif /*AT_FRAMER_H*/
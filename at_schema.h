@@ -0,0 +1,136 @@
+/* Infineon X-Gold RIL
+**
+** Copyright 2006, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+**
+** Based on reference-ril by - Copyright 2006, The Android Open Source Project
+** Modified September 2009 by Texas Instruments
+*/
+
+#ifndef AT_SCHEMA_H
+#define AT_SCHEMA_H 1
+
+#include <string.h>
+#include "at_tok.h"
+
+/*
+ * Typed response schemas.
+ *
+ * A schema is an X-macro listing the fields of one kind of response line,
+ * in order, as F(kind, name, size, presence):
+ *
+ *   INT   base 10 integer, stored as int name
+ *   HEX   base 16 integer, stored as int name
+ *   BOOL  0 or 1, stored as char name
+ *   STR   string without its quotes, copied into char name[size]; if
+ *         the field is optional and does not fit, name is left empty
+ *   SKIP  a field that is read past and not stored
+ *
+ * presence is AT_REQUIRED or AT_OPTIONAL. Once one field is optional all
+ * the fields after it must be too; a line may end before any of them.
+ *
+ *   #define CSQ_FIELDS(F) \
+ *       F(INT, rssi, 0, AT_REQUIRED) \
+ *       F(INT, ber,  0, AT_OPTIONAL)
+ *
+ *   AT_SCHEMA(CSQLine, CSQ_FIELDS)
+ *
+ * declares the struct CSQLine and a parser
+ *
+ *   static int parseCSQLine(const char *line, CSQLine *p_out);
+ *
+ * which returns 0 on success and -1 on fail. p_out->count is the number
+ * of fields present; fields that are not present are zeroed. The parser
+ * is straight-line code with one step per field over the fields
+ * at_tok_index() found, does not allocate and leaves line untouched.
+ * Like at_tok_index() it fails on lines of more than AT_TOK_MAX_FIELDS
+ * fields.
+ *
+ * Lines that come in more than one layout, such as the solicited and
+ * unsolicited forms of +CREG:, get one schema per layout; the caller
+ * picks the parser.
+ */
+
+#define AT_REQUIRED 0
+#define AT_OPTIONAL 1
+
+#define AT_SCHEMA_MEMBER_INT(name, size)  int name;
+#define AT_SCHEMA_MEMBER_HEX(name, size)  int name;
+#define AT_SCHEMA_MEMBER_BOOL(name, size) char name;
+#define AT_SCHEMA_MEMBER_STR(name, size)  char name[size];
+#define AT_SCHEMA_MEMBER_SKIP(name, size)
+
+#define AT_SCHEMA_MEMBER(kind, name, size, presence) \
+    AT_SCHEMA_MEMBER_##kind(name, size)
+
+#define AT_SCHEMA_READ_INT(tok, n, name, size, presence) \
+    at_tok_fieldint(&(tok), n, &p_out->name)
+#define AT_SCHEMA_READ_HEX(tok, n, name, size, presence) \
+    at_tok_fieldhexint(&(tok), n, &p_out->name)
+#define AT_SCHEMA_READ_BOOL(tok, n, name, size, presence) \
+    at_tok_fieldbool(&(tok), n, &p_out->name)
+#define AT_SCHEMA_READ_STR(tok, n, name, size, presence) \
+    at_schema_str(&(tok), n, p_out->name, size, presence)
+#define AT_SCHEMA_READ_SKIP(tok, n, name, size, presence) 0
+
+#define AT_SCHEMA_READ(kind, name, size, presence) \
+    if (p_out->count == tok.count) { \
+        return (presence) == AT_OPTIONAL ? 0 : -1; \
+    } \
+    if (AT_SCHEMA_READ_##kind(tok, p_out->count, name, size, \
+                                presence) < 0) { \
+        return -1; \
+    } \
+    p_out->count++;
+
+#define AT_SCHEMA(type, FIELDS) \
+    typedef struct { \
+        int count; \
+        FIELDS(AT_SCHEMA_MEMBER) \
+    } type; \
+    \
+    static int parse##type(const char *line, type *p_out) \
+    { \
+        ATTokIndex tok; \
+        \
+        memset(p_out, 0, sizeof(*p_out)); \
+        \
+        if (at_tok_index(line, &tok) < 0) { \
+            return -1; \
+        } \
+        \
+        FIELDS(AT_SCHEMA_READ) \
+        return 0; \
+    }
+
+/**
+ * Copies STR field n into buf. An optional field that does not fit is
+ * left empty rather than failing the whole line
+ */
+static inline int at_schema_str(const ATTokIndex *p_tok, int n,
+                                char *buf, size_t size, int presence)
+{
+    if (at_tok_fieldcopy(p_tok, n, buf, size) == 0) {
+        return 0;
+    }
+
+    if (presence == AT_OPTIONAL) {
+        buf[0] = '\0';
+        return 0;
+    }
+
+    return -1;
+}
+
+#endif /*AT_SCHEMA_H*/
@@ -20,9 +20,184 @@
 
 #include "at_tok.h"
 #include <string.h>
-#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#if defined(AT_TOK_SCALAR)
+/* vectors left out, for tools/tok_bench.c to compare against */
+#elif defined(__SSE2__) || defined(__x86_64__)
+#define HAVE_SSE2_TOKENIZER 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_TOKENIZER 1
+#include <arm_neon.h>
+#endif
+
+#define BLOCK_SIZE 16
+#define IS_ALIGNED(p) (((uintptr_t) (p) & (BLOCK_SIZE - 1)) == 0)
+
+/** isspace() in the C locale, without the table lookup */
+static int isSpace(char c)
+{
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+/**
+ * returns a pointer to the first c in s,
+ * or to the terminating NUL if there is none. Fields are shorter than
+ * a vector block, so a byte loop beats one (see tools/tok_bench.c)
+ */
+static char * findDelimiter(const char *s, char c)
+{
+    while (*s != c && *s != '\0') {
+        s++;
+    }
+
+    return (char *) s;
+}
+
+/*
+ * The vector scan below steps a byte at a time up to a 16 byte boundary
+ * and then loads whole aligned blocks. An aligned block can read past the
+ * terminating NUL, but never past the page that holds it.
+ */
+
+/** returns the number of c in s */
+static int countChar(const char *s, char c)
+{
+    int count = 0;
+#if defined(HAVE_SSE2_TOKENIZER)
+    const __m128i needle = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int found, end;
+    __m128i v;
+#elif defined(HAVE_NEON_TOKENIZER)
+    const uint8x16_t needle = vdupq_n_u8((uint8_t) c);
+    const uint8x16_t zero = vdupq_n_u8(0);
+    uint8x16_t v, ends;
+    uint64x2_t sums;
+#endif
+
+#if defined(HAVE_SSE2_TOKENIZER) || defined(HAVE_NEON_TOKENIZER)
+    for ( ; !IS_ALIGNED(s) && *s != '\0' ; s++) {
+        count += (*s == c);
+    }
+
+    if (*s == '\0') {
+        return count;
+    }
+#endif
+
+#if defined(HAVE_SSE2_TOKENIZER)
+    for ( ; ; s += BLOCK_SIZE) {
+        v = _mm_load_si128((const __m128i *) s);
+        found = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        end = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+        if (end != 0) {
+            // only count the bytes before the NUL
+            return count + __builtin_popcount(found & ((end & -end) - 1));
+        }
+
+        count += __builtin_popcount(found);
+    }
+#elif defined(HAVE_NEON_TOKENIZER)
+    for ( ; ; s += BLOCK_SIZE) {
+        v = vld1q_u8((const uint8_t *) s);
+        ends = vceqq_u8(v, zero);
+
+        if ((vgetq_lane_u64(vreinterpretq_u64_u8(ends), 0)
+                | vgetq_lane_u64(vreinterpretq_u64_u8(ends), 1)) != 0) {
+            break;
+        }
+
+        // each match is 0xff; sum the low bits across the block
+        v = vandq_u8(vceqq_u8(v, needle), vdupq_n_u8(1));
+        sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(v)));
+        count += (int) (vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1));
+    }
+#endif
+
+    // the block holding the NUL, or the whole string without vectors
+    for ( ; *s != '\0' ; s++) {
+        count += (*s == c);
+    }
+
+    return count;
+}
+
+/** value of a hex digit, or 16 if c is not one */
+static unsigned int digitValue(char c)
+{
+    unsigned int d;
+
+    d = (unsigned char) c - '0';
+    if (d < 10) {
+        return d;
+    }
+
+    // folding to lower case maps 'A'-'F' onto 'a'-'f'
+    d = ((unsigned char) c | 0x20) - 'a';
+    if (d < 6) {
+        return d + 10;
+    }
+
+    return 16;
+}
+
+/**
+ * Parses an integer like strtol() (base 10) or strtoul() (base 16) in the
+ * C locale, but fails rather than saturates if the value does not fit:
+ * signed int for base 10, unsigned int for base 16.
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_parseint(const char *s, int *p_out, unsigned int base)
+{
+    unsigned int value = 0;
+    unsigned int limit, cutoff, cutlim, d;
+    int negative = 0;
+    const char *digits;
+
+    while (isSpace(*s)) {
+        s++;
+    }
+
+    if (*s == '-' || *s == '+') {
+        negative = (*s == '-');
+        s++;
+    }
+
+    if (base == 16 && s[0] == '0' && (s[1] | 0x20) == 'x'
+            && digitValue(s[2]) < 16) {
+        s += 2;
+    }
+
+    if (base == 16) {
+        limit = UINT_MAX;
+    } else {
+        limit = negative ? (unsigned int) INT_MAX + 1 : INT_MAX;
+    }
+
+    cutoff = limit / base;
+    cutlim = limit % base;
+
+    for (digits = s ; (d = digitValue(*s)) < base ; s++) {
+        if (value > cutoff || (value == cutoff && d > cutlim)) {
+            return -1;
+        }
+        value = value * base + d;
+    }
+
+    if (s == digits) {
+        return -1;
+    }
+
+    *p_out = (int) (negative ? -value : value);
+
+    return 0;
+}
+
 /**
  * Starts tokenizing an AT response string
  * returns -1 if this is not a valid response string, 0 on success.
@@ -52,7 +227,7 @@ static void skipWhiteSpace(char **p_cur)
 {
     if (*p_cur == NULL) return;
 
-    while (**p_cur != '\0' && isspace(**p_cur)) {
+    while (isSpace(**p_cur)) {
         (*p_cur)++;
     }
 }
@@ -61,15 +236,31 @@ static void skipNextComma(char **p_cur)
 {
     if (*p_cur == NULL) return;
 
-    while (**p_cur != '\0' && **p_cur != ',') {
-        (*p_cur)++;
-    }
+    *p_cur = findDelimiter(*p_cur, ',');
 
     if (**p_cur == ',') {
         (*p_cur)++;
     }
 }
 
+/** strsep() with a single delimiter */
+static char * splitAt(char **p_cur, char delim)
+{
+    char *ret = *p_cur;
+    char *end;
+
+    end = findDelimiter(ret, delim);
+
+    if (*end == '\0') {
+        *p_cur = NULL;
+    } else {
+        *end = '\0';
+        *p_cur = end + 1;
+    }
+
+    return ret;
+}
+
 static char * nextTok(char **p_cur)
 {
     char *ret = NULL;
@@ -80,10 +271,10 @@ static char * nextTok(char **p_cur)
         ret = NULL;
     } else if (**p_cur == '"') {
         (*p_cur)++;
-        ret = strsep(p_cur, "\"");
+        ret = splitAt(p_cur, '"');
         skipNextComma(p_cur);
     } else {
-        ret = strsep(p_cur, ",");
+        ret = splitAt(p_cur, ',');
     }
 
     return ret;
@@ -94,10 +285,10 @@ static char * nextTok(char **p_cur)
  * Parses the next integer in the AT response line and places it in *p_out
  * returns 0 on success and -1 on fail
  * updates *p_cur
- * "base" is the same as the base param in strtol
+ * "base" is 10 or 16
  */
 
-static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
+static int at_tok_nextint_base(char **p_cur, int *p_out, unsigned int base)
 {
     char *ret;
 
@@ -109,23 +300,9 @@ static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
 
     if (ret == NULL) {
         return -1;
-    } else {
-        long l;
-        char *end;
-
-        if (uns)
-            l = strtoul(ret, &end, base);
-        else
-            l = strtol(ret, &end, base);
-
-        *p_out = (int)l;
-
-        if (end == ret) {
-            return -1;
-        }
     }
 
-    return 0;
+    return at_tok_parseint(ret, p_out, base);
 }
 
 /**
@@ -136,7 +313,7 @@ static int at_tok_nextint_base(char **p_cur, int *p_out, int base, int  uns)
  */
 int at_tok_nextint(char **p_cur, int *p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 10, 0);
+    return at_tok_nextint_base(p_cur, p_out, 10);
 }
 
 /**
@@ -147,7 +324,7 @@ int at_tok_nextint(char **p_cur, int *p_out)
  */
 int at_tok_nexthexint(char **p_cur, int *p_out)
 {
-    return at_tok_nextint_base(p_cur, p_out, 16, 1);
+    return at_tok_nextint_base(p_cur, p_out, 16);
 }
 
 int at_tok_nextbool(char **p_cur, char *p_out)
@@ -193,20 +370,194 @@ int at_tok_hasmore(char **p_cur)
 /** *p_out returns count of given character (needle) in given string (p_in). */
 int at_tok_charcounter(char *p_in, char needle, int *p_out)
 {
-    char *p_cur = p_in;
-    int num_found = 0;
-
     if (p_in == NULL)
         return -1;
 
-    while (*p_cur != '\0') {
-        if (*p_cur == needle) {
-            num_found++;
+    *p_out = countChar(p_in, needle);
+    return 0;
+}
+
+static void addField(ATTokIndex *p_index, const char *start, const char *end)
+{
+    p_index->fields[p_index->count].offset = start - p_index->line;
+    p_index->fields[p_index->count].length = end - start;
+    p_index->count++;
+}
+
+/**
+ * Indexes the fields of an AT response line in one pass, splitting them
+ * the same way at_tok_start() and successive at_tok_next*() calls would.
+ * The line is not modified.
+ * returns -1 if this is not a valid response string or it has more than
+ * AT_TOK_MAX_FIELDS fields, 0 on success.
+ */
+int at_tok_index(const char *line, ATTokIndex *p_index)
+{
+    const char *p;
+    const char *end;
+
+    if (line == NULL) {
+        return -1;
+    }
+
+    p = strchr(line, ':');
+
+    if (p == NULL) {
+        return -1;
+    }
+
+    p++;
+
+    p_index->line = line;
+    p_index->count = 0;
+
+    while (*p != '\0') {
+        if (p_index->count == AT_TOK_MAX_FIELDS) {
+            return -1;
+        }
+
+        while (isSpace(*p)) {
+            p++;
         }
 
-        p_cur++;
+        if (*p == '"') {
+            p++;
+            end = findDelimiter(p, '"');
+            addField(p_index, p, end);
+
+            if (*end == '\0') {
+                break;
+            }
+
+            p = findDelimiter(end + 1, ',');
+
+            if (*p == ',') {
+                p++;
+            }
+        } else {
+            end = findDelimiter(p, ',');
+            addField(p_index, p, end);
+
+            if (*end == '\0') {
+                break;
+            }
+
+            p = end + 1;
+        }
+    }
+
+    return 0;
+}
+
+/** returns the number of fields in an indexed line */
+int at_tok_fieldcount(const ATTokIndex *p_index)
+{
+    return p_index->count;
+}
+
+static const char * fieldStart(const ATTokIndex *p_index, int n)
+{
+    if (n < 0 || n >= p_index->count) {
+        return NULL;
+    }
+
+    return p_index->line + p_index->fields[n].offset;
+}
+
+/**
+ * Parses field n of an indexed line as a base 10 integer
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_fieldint(const ATTokIndex *p_index, int n, int *p_out)
+{
+    const char *start = fieldStart(p_index, n);
+
+    if (start == NULL) {
+        return -1;
+    }
+
+    // a field always ends on a byte that is not a digit
+    return at_tok_parseint(start, p_out, 10);
+}
+
+/**
+ * Parses field n of an indexed line as a base 16 integer
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_fieldhexint(const ATTokIndex *p_index, int n, int *p_out)
+{
+    const char *start = fieldStart(p_index, n);
+
+    if (start == NULL) {
+        return -1;
+    }
+
+    return at_tok_parseint(start, p_out, 16);
+}
+
+int at_tok_fieldbool(const ATTokIndex *p_index, int n, char *p_out)
+{
+    int result;
+
+    if (at_tok_fieldint(p_index, n, &result) < 0) {
+        return -1;
+    }
+
+    // booleans should be 0 or 1
+    if (!(result == 0 || result == 1)) {
+        return -1;
+    }
+
+    if (p_out != NULL) {
+        *p_out = (char)result;
+    }
+
+    return 0;
+}
+
+/**
+ * Points *pp_out at field n of an indexed line, without its quotes.
+ * The field is not NUL terminated; *p_length is its length.
+ * returns 0 on success and -1 on fail
+ */
+int at_tok_fieldstr(const ATTokIndex *p_index, int n,
+                        const char **pp_out, int *p_length)
+{
+    const char *start = fieldStart(p_index, n);
+
+    if (start == NULL) {
+        return -1;
     }
 
-    *p_out = num_found;
+    *pp_out = start;
+    *p_length = p_index->fields[n].length;
+
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Copies field n of an indexed line, without its quotes, into buf as a
+ * NUL terminated string
+ * returns 0 on success and -1 on fail, including when it does not fit
+ */
+int at_tok_fieldcopy(const ATTokIndex *p_index, int n,
+                        char *buf, size_t size)
+{
+    const char *start = fieldStart(p_index, n);
+    size_t length;
+
+    if (start == NULL) {
+        return -1;
+    }
+
+    length = p_index->fields[n].length;
+
+    if (length >= size) {
+        return -1;
+    }
+
+    memcpy(buf, start, length);
+    buf[length] = '\0';
+
+    return 0;
+}
@@ -21,6 +21,23 @@
 #ifndef AT_TOK_H
 #define AT_TOK_H 1
 
+#include <stddef.h>
+
+#define AT_TOK_MAX_FIELDS 32
+
+/**
+ * Field offsets into a response line, built by at_tok_index() without
+ * modifying the line. The line must outlive the index.
+ */
+typedef struct {
+    const char *line;
+    int count;
+    struct {
+        unsigned short offset;  /* past any opening quote */
+        unsigned short length;  /* without the quotes */
+    } fields[AT_TOK_MAX_FIELDS];
+} ATTokIndex;
+
 int at_tok_start(char **p_cur);
 int at_tok_nextint(char **p_cur, int *p_out);
 int at_tok_nexthexint(char **p_cur, int *p_out);
@@ -31,4 +48,15 @@ int at_tok_nextstr(char **p_cur, char **out);
 int at_tok_hasmore(char **p_cur);
 
 int at_tok_charcounter(char *p_in, char needle, int *p_out);
+int at_tok_parseint(const char *s, int *p_out, unsigned int base);
+
+int at_tok_index(const char *line, ATTokIndex *p_index);
+int at_tok_fieldcount(const ATTokIndex *p_index);
+int at_tok_fieldint(const ATTokIndex *p_index, int n, int *p_out);
+int at_tok_fieldhexint(const ATTokIndex *p_index, int n, int *p_out);
+int at_tok_fieldbool(const ATTokIndex *p_index, int n, char *p_out);
+int at_tok_fieldstr(const ATTokIndex *p_index, int n,
+                        const char **pp_out, int *p_length);
+int at_tok_fieldcopy(const ATTokIndex *p_index, int n,
+                        char *buf, size_t size);
 #endif /*AT_TOK_H */
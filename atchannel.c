@@ -20,6 +20,7 @@
 
 #include "atchannel.h"
 #include "at_tok.h"
+#include "at_framer.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -29,6 +30,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -43,25 +50,94 @@
 
 #include "misc.h"
 
-#ifdef HAVE_ANDROID_OS
-#define USE_NP 1
-#endif /* HAVE_ANDROID_OS */
-
 
 #define NUM_ELEMS(x) (sizeof(x)/sizeof(x[0]))
 
-#define MAX_AT_RESPONSE (8 * 1024)
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
+#define MAX_EPOLL_EVENTS 8
+#define MAX_PIPELINE_DEPTH 8
+#define MAX_AT_CHANNELS 4
+#define MAX_BATCH_LINE 80       /* V.250 command line, AT and CR excluded */
+#define MAX_COMMAND_ABORTS 3       /* then an abortable command is let
+                                      run to completion */
+#define SHARED_QUERY_WINDOW_MSEC 250 /* how long a query result is
+                                        reused */
+#define PRIORITY_AGING_MSEC 2000   /* waiting this long raises a command
+                                      by one scheduling class */
+#define DEFAULT_TIMEOUT_MSEC 30000
+#define CPIN_FINAL_TIMEOUT_MSEC 5000 /* how long the +CPIN fix waits for
+                                        the final response it swallows */
+#define MIN_ADAPTIVE_TIMEOUT_MSEC 200
+#define RTT_TABLE_SIZE 64       /* must be a power of two */
+#define RTT_BUCKETS 18          /* powers of two, up to 2^18 msec */
+#define RTT_MIN_SAMPLES 32
+#define RTT_MAX_SAMPLES 1024    /* older samples are halved away */
+#define RTT_PERCENTILE 99
+#define RTT_MARGIN 4
+#define OUTPUT_QUEUE_SIZE 4096
+#define ARENA_SIZE 2048
+#define ARENA_POOL_SIZE 4
+#define DISPATCH_RING_SIZE 64      /* must be a power of two */
+#define MAX_DISPATCH_OVERFLOW 1024
 
 static pthread_t s_tid_reader;
-static int s_fd = -1;    /* fd of the AT channel */
 static ATUnsolHandler s_unsolHandler;
 
-/* for input buffering */
+/*
+ * the reader thread sleeps in epoll_wait() on these and on the (non-
+ * blocking) fds of the channels. s_wakefd is written by at_close() to
+ * stop the reader and s_timerfd is armed with the earliest deadline of
+ * the pending commands
+ */
+static int s_epfd = -1;
+static int s_wakefd = -1;
+static int s_timerfd = -1;
+static int s_readerRunning; /* protected by s_commandmutex */
+/* set until readerLoop() returns; an at_close() from the reader thread
+   (eg from s_onTimeout) leaves it running detached, and at_open() must
+   not reset the channels under it. Guarded by s_commandmutex */
+static int s_readerThreadRunning;
+static pthread_cond_t s_readerExitCond = PTHREAD_COND_INITIALIZER;
 
-static char s_ATBuffer[MAX_AT_RESPONSE+1];
-static char *s_ATBufferCur = s_ATBuffer;
+/*
+ * unsolicited responses and completions of asynchronous commands are
+ * handed to a separate dispatch thread, so a slow handler or callback
+ * never holds up the reader or command completion
+ *
+ * s_dispatchRing is a lock-free single-producer (reader) single-consumer
+ * (dispatcher) ring: only the reader advances s_dispatchHead and only
+ * the dispatcher advances s_dispatchTail. If the dispatcher falls
+ * behind, entries spill into the overflow list (protected by
+ * s_dispatchMutex) instead of stalling the reader, which a handler issuing
+ * AT commands would be waiting on. Other threads always use the
+ * overflow list.
+ */
+typedef struct ATDispatchEntry {
+    struct ATDispatchEntry *p_next; /* overflow list only */
+    struct ATCommand *p_cmd;        /* completed async command, or NULL */
+    char *line;                     /* else an unsolicited response */
+    char *smsPdu;                   /* NULL unless a two-line SMS response */
+} ATDispatchEntry;
+
+static ATDispatchEntry *s_dispatchRing[DISPATCH_RING_SIZE];
+static volatile unsigned s_dispatchHead;
+static volatile unsigned s_dispatchTail;
+
+static pthread_mutex_t s_dispatchMutex = PTHREAD_MUTEX_INITIALIZER;
+static ATDispatchEntry *sp_dispatchOverflowHead = NULL;
+static ATDispatchEntry *sp_dispatchOverflowTail = NULL;
+static volatile int s_dispatchOverflowCount;
+
+static pthread_t s_tid_dispatcher;
+static int s_dispatchfd = -1;      /* eventfd, wakes the dispatcher */
+static int s_dispatchPending;      /* reader: queued since last wakeup */
+static volatile int s_dispatcherStop;
+/* set until dispatchLoop() returns; an at_close() from a handler leaves
+   the dispatcher running detached, and at_open() must not reset the ring
+   under it. Guarded by s_dispatchMutex */
+static int s_dispatcherRunning;
+static pthread_cond_t s_dispatcherExitCond = PTHREAD_COND_INITIALIZER;
 
 static int s_ackPowerIoctl; /* true if TTY has android byte-count
                                 handshake for low power*/
@@ -76,41 +152,360 @@ void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 }
 #endif
 
+typedef enum {
+    CMD_NEW,
+    CMD_WAITING,            /* on its channel's waiting queue */
+    CMD_IN_FLIGHT,          /* on its channel's inFlight queue */
+    CMD_SHARED,             /* a follower of an identical query */
+    CMD_DONE
+} ATCommandState;
+
+/*
+ * scheduling classes, most urgent first. Waiting commands are written
+ * in class order, earliest due time first within a class
+ */
+typedef enum {
+    PRIORITY_CALL,          /* dial, answer, hangup, DTMF */
+    PRIORITY_SMS,
+    PRIORITY_DATA,
+    PRIORITY_DEFAULT,       /* setup, SIM and anything not listed */
+    PRIORITY_NETWORK,       /* signal, operator and registration polls */
+    PRIORITY_DIAGNOSTICS,   /* identity and version queries */
+    PRIORITY_COUNT
+} ATCommandPriority;
+
+typedef struct ATCommand {
+    struct ATCommand *p_next;
+    const char *command;
+    ATCommandType type;
+    const char *responsePrefix;
+    const char *smsPDU;
+    ATResponse *p_response;
+    long long timeoutMsec;  /* 0 for none */
+    long long started;      /* CLOCK_MONOTONIC msec it became the oldest
+                               in flight, ie when the modem started on it */
+    long long deadline;     /* CLOCK_MONOTONIC msec, 0 for none */
+    ATCommandState state;
+    ATCommandPriority priority;
+    long long submitted;    /* CLOCK_MONOTONIC msec it was queued */
+    long long due;          /* submitted + timeout, for EDF ordering */
+    struct ATChannel *p_channel;    /* where it is queued and written;
+                                       if set before submitting, it is
+                                       not routed */
+    int err;                /* AT_ERROR_* or 0, once CMD_DONE */
+    int barrier;            /* nothing else may be in flight with this one */
+    int aborting;           /* abort character sent, awaiting its final
+                               response */
+    int aborts;             /* times it was aborted and requeued */
+    const struct ATSharedQuery *p_sharedQuery; /* NULL if not shareable */
+    struct ATCommand *p_leader;     /* the query this one follows */
+    struct ATCommand *p_followers;  /* linked through p_next */
+    const ATBatchCommand *p_batch;  /* the commands concatenated into
+                                       command, NULL if not a batch */
+    int batchCount;
+    ATResponseCallback callback;    /* NULL for blocking callers */
+    void *param;
+    ATDispatchEntry completion;     /* hands callback to the dispatcher */
+} ATCommand;
+
+typedef struct {
+    ATCommand *p_head;
+    ATCommand *p_tail;
+    int count;
+} ATCommandQueue;
+
+/*
+ * one stream of AT traffic: the tty itself, or a CMUX DLC or extra port
+ * added with at_add_channel(). s_channels[0] is the primary channel
+ * opened by at_open(); routeCommand() picks the channel for a command
+ *
+ * the queues and the output buffer are protected by s_commandmutex,
+ * the framer and smsUnsolLine belong to the reader thread
+ */
+typedef struct ATChannel {
+    int fd;
+    ATChannelRole role;
+
+    /* for input buffering */
+    ATFramer framer;
+
+    /* first line of a two-line SMS unsolicited response, waiting for
+       the PDU */
+    char *smsUnsolLine;
+
+    /*
+     * commands wait on waiting until the pipeline has room for them and
+     * are then in flight in the order they were written; each final
+     * response completes the oldest one
+     */
+    ATCommandQueue waiting;
+    ATCommandQueue inFlight;
+
+    /*
+     * output the fd would not take yet, oldest first; appended by
+     * writeline() and writeCtrlZ() and drained by the reader on EPOLLOUT
+     */
+    char outQueue[OUTPUT_QUEUE_SIZE];
+    size_t outQueueLen;
+
+    /*
+     * CLOCK_MONOTONIC msec, 0 for none. While set, the +CPIN fix has
+     * completed a command before its final response; nothing is written
+     * until that response has been read and dropped, or until then
+     */
+    long long swallowDeadline;
+} ATChannel;
+
 /*
- * for current pending command
+ * for pending commands
  * these are protected by s_commandmutex
+ *
+ * Blocking callers wait on s_commandcond for their command to reach
+ * CMD_DONE.
  */
 
 static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
 
-static ATCommandType s_type;
-static const char *s_responsePrefix = NULL;
-static const char *s_smsPDU = NULL;
-static ATResponse *sp_response = NULL;
+static ATChannel s_channels[MAX_AT_CHANNELS];
+static int s_channelCount = 0;
+static int s_pipelineDepth = 1;
+
+/* commands that go to the AT_CHANNEL_LONG channel, if there is one */
+static const char * s_longCommands[] = {
+    "AT+COPS=?",    /* network scan */
+    "AT+CGACT=",
+    "AT+CLCK=",     /* these may have to ask the network */
+    "AT+CCFC=",
+    "AT+CCWA=",
+    "AT+CUSD=",
+};
+
+/*
+ * commands that go to the AT_CHANNEL_UNSOLICITED channel, if there is
+ * one. The modem reports unsolicited responses on the port they were
+ * enabled on, so enabling them there keeps them off the command port
+ */
+static const char * s_unsolicitedCommands[] = {
+    "AT+CREG=",
+    "AT+CGREG=",
+    "AT+CGEREP=",
+    "AT+CNMI=",
+    "AT+CSSN=",
+    "AT+CMER=",
+    "AT+CTZR=",
+    "AT+CTZU=",
+    "AT+XMER=",     /* +XCIEV */
+    "AT+XCALLSTAT=",
+};
+
+/*
+ * timeouts for commands sent with AT_TIMEOUT_DEFAULT, matched by
+ * prefix, first match wins; anything else gets DEFAULT_TIMEOUT_MSEC
+ */
+static const struct {
+    const char *prefix;
+    long long timeoutMsec;
+} s_commandTimeouts[] = {
+    { "AT+COPS=?", 180000 },    /* network scan */
+    { "AT+COPS=",  180000 },    /* network selection */
+    { "AT+CGACT=", 150000 },
+    { "AT+CGATT=", 150000 },
+    { "AT+CLCK=",   90000 },    /* these may have to ask the network */
+    { "AT+CCFC=",   90000 },
+    { "AT+CCWA=",   90000 },
+    { "AT+CUSD=",   90000 },
+    { "AT+CPWD=",   90000 },
+    { "ATD",        60000 },
+    { "AT+CMGS=",   60000 },
+    { "AT+CFUN=",   60000 },
+};
+
+/*
+ * commands at_send_batch() always sends on a line of their own: dialling
+ * and answering take the rest of the line as dial string or data, and
+ * a reset discards it
+ */
+static const char * s_unbatchableCommands[] = {
+    "ATD",
+    "ATA",
+    "ATO",
+    "ATZ",
+    "AT&F",
+};
+
+/*
+ * long commands the modem stops when it receives any character
+ * (V.250 5.6.1). They are aborted and requeued when a more urgent
+ * command is submitted behind them on the same channel
+ */
+static const char * s_abortableCommands[] = {
+    "AT+COPS=?",    /* network scan */
+};
+
+/*
+ * read-only queries that are answered once for every caller asking at
+ * the same time: a caller that sends one while an identical one is
+ * pending, or within SHARED_QUERY_WINDOW_MSEC of its success, gets a
+ * copy of that response. Matched on the whole command line
+ */
+typedef struct ATSharedQuery {
+    const char *command;
+    ATCommandType type;
+    const char *responsePrefix;
+} ATSharedQuery;
+
+static const ATSharedQuery s_sharedQueries[] = {
+    { "AT+CSQ",    SINGLELINE, "+CSQ:" },
+    { "AT+CREG?",  SINGLELINE, "+CREG:" },
+    { "AT+CGREG?", SINGLELINE, "+CGREG:" },
+    { "AT+COPS?",  SINGLELINE, "+COPS:" },
+    { "AT+CPIN?",  SINGLELINE, "+CPIN:" },
+    { "AT+CGATT?", SINGLELINE, "+CGATT:" },
+    { "AT+CGACT?", MULTILINE,  "+CGACT:" },
+};
+
+/*
+ * the last successful response to each of s_sharedQueries, protected
+ * by s_commandmutex. An entry is only reused if no unsolicited response
+ * has arrived since, as that may have changed the answer
+ */
+static struct {
+    ATResponse *p_response;
+    long long completed;
+    unsigned unsolicitedCount;
+} s_sharedResults[NUM_ELEMS(s_sharedQueries)];
+
+/* bumped by the reader for every unsolicited response */
+static volatile unsigned s_unsolicitedCount = 0;
+
+/*
+ * scheduling class of each command, matched by prefix, first match
+ * wins; anything else is PRIORITY_DEFAULT
+ */
+static const struct {
+    const char *prefix;
+    ATCommandPriority priority;
+} s_commandPriorities[] = {
+    { "ATD*99",      PRIORITY_DATA },   /* PDP dial, not a call */
+    { "ATD",         PRIORITY_CALL },
+    { "ATA",         PRIORITY_CALL },
+    { "ATH",         PRIORITY_CALL },
+    { "AT+CHUP",     PRIORITY_CALL },
+    { "AT+CHLD=",    PRIORITY_CALL },
+    { "AT+VTS=",     PRIORITY_CALL },
+    { "AT+CMUT=",    PRIORITY_CALL },
+    { "AT+CLCC",     PRIORITY_CALL },
+    { "AT+CMGS=",    PRIORITY_SMS },
+    { "AT+CMGW=",    PRIORITY_SMS },
+    { "AT+CMGD=",    PRIORITY_SMS },
+    { "AT+CNMA",     PRIORITY_SMS },
+    { "AT+CGDCONT=", PRIORITY_DATA },
+    { "AT+CGACT",    PRIORITY_DATA },
+    { "AT+CGDATA",   PRIORITY_DATA },
+    { "AT+CGQ",      PRIORITY_DATA },
+    { "AT+CGPADDR",  PRIORITY_DATA },
+    { "AT%DATA",     PRIORITY_DATA },
+    { "AT+CSQ",      PRIORITY_NETWORK },
+    { "AT+COPS?",    PRIORITY_NETWORK },
+    { "AT+COPS=3,",  PRIORITY_NETWORK }, /* format changes around COPS? */
+    { "AT+COPS=?",   PRIORITY_NETWORK },
+    { "AT+CREG?",    PRIORITY_NETWORK },
+    { "AT+CGREG?",   PRIORITY_NETWORK },
+    { "AT+CGATT?",   PRIORITY_NETWORK },
+    { "AT+CGMI",     PRIORITY_DIAGNOSTICS },
+    { "AT+CGMM",     PRIORITY_DIAGNOSTICS },
+    { "AT+CGMR",     PRIORITY_DIAGNOSTICS },
+    { "AT+CGSN",     PRIORITY_DIAGNOSTICS },
+    { "AT+CIMI",     PRIORITY_DIAGNOSTICS },
+    { "AT+CEER",     PRIORITY_DIAGNOSTICS },
+    { "ATI",         PRIORITY_DIAGNOSTICS },
+};
+
+/*
+ * response times seen per command name, used to tighten the default
+ * timeouts when s_adaptiveTimeouts is set. protected by s_commandmutex
+ */
+typedef struct {
+    char name[16];              /* eg "AT+CSQ", "AT+COPS=?", "ATD" */
+    unsigned count;
+    unsigned buckets[RTT_BUCKETS]; /* [i] counts rtt < 2^(i+1) msec */
+} ATRttStats;
+
+static ATRttStats s_rttStats[RTT_TABLE_SIZE];
+static int s_adaptiveTimeouts = 0;
 
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
 static int s_readerClosed;
 
+/*
+ * every ATResponse lives at the start of one of these; its lines and
+ * final response are bump-allocated from data[] (and from overflow
+ * chunks if a response outgrows it), so freeing is a single free()
+ */
+typedef struct ATArenaChunk {
+    struct ATArenaChunk *p_next;
+    size_t used;
+    size_t size;
+    char data[];
+} ATArenaChunk;
+
+typedef struct ATArena {
+    ATResponse response;        /* must be first */
+    struct ATArena *p_nextFree; /* link in s_arenaPool */
+    ATLine *p_tail;             /* last intermediate, for in-order append */
+    ATArenaChunk *p_chunks;     /* overflow chunks, newest first */
+    size_t used;
+    char data[ARENA_SIZE];
+} ATArena;
+
+/* released arenas kept for reuse; protected by s_arenaMutex */
+static pthread_mutex_t s_arenaMutex = PTHREAD_MUTEX_INITIALIZER;
+static ATArena *s_arenaPool = NULL;
+static int s_arenaPoolCount = 0;
+
 static void onReaderClosed();
-static int writeCtrlZ (const char *s);
-static int writeline (const char *s);
+static int writeCtrlZ (ATChannel *p_channel, const char *s);
+static int writeAbort (ATChannel *p_channel);
+static ATResponse * at_response_new();
+static void completeSharedQuery(ATCommand *p_cmd);
+static int shareQuery(ATCommand *p_cmd);
+static void forgetSharedResults();
+static int writeline (ATChannel *p_channel, const char *s);
+static void drainOutputQueue(ATChannel *p_channel);
+static void queueCompletion(ATCommand *p_cmd);
+
+static long long monotonicMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-#ifndef USE_NP
-static void setTimespecRelative(struct timespec *p_ts, long long msec)
+/**
+ * Arms s_timerfd to fire in msec milliseconds, or disarms it
+ * if msec is 0. Re-arming also discards any expiration that has not
+ * been read yet.
+ */
+static void setCommandTimer(long long msec)
 {
-    struct timeval tv;
+    struct itimerspec its;
+
+    if (s_timerfd < 0) {
+        return;
+    }
 
-    gettimeofday(&tv, (struct timezone *) NULL);
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msec / 1000;
+    its.it_value.tv_nsec = (msec % 1000) * 1000L * 1000L;
 
-    /* what's really funny about this is that I know
-       pthread_cond_timedwait just turns around and makes this
-       a relative time again */
-    p_ts->tv_sec = tv.tv_sec + (msec / 1000);
-    p_ts->tv_nsec = (tv.tv_usec + (msec % 1000) * 1000L ) * 1000L;
+    if (timerfd_settime(s_timerfd, 0, &its, NULL) < 0) {
+        LOGE("atchannel: timerfd_settime failed %s", strerror(errno));
+    }
 }
-#endif /*USE_NP*/
 
 static void sleepMsec(long long msec)
 {
@@ -127,147 +522,1337 @@ static void sleepMsec(long long msec)
 
 
 
-/** add an intermediate response to sp_response*/
-static void addIntermediate(const char *line)
+/** assumes s_commandmutex is held */
+static void enqueueCommand(ATCommandQueue *p_queue, ATCommand *p_cmd)
 {
-    ATLine *p_new;
+    p_cmd->p_next = NULL;
+
+    if (p_queue->p_tail == NULL) {
+        p_queue->p_head = p_cmd;
+    } else {
+        p_queue->p_tail->p_next = p_cmd;
+    }
+    p_queue->p_tail = p_cmd;
+    p_queue->count++;
+}
+
+/** assumes s_commandmutex is held */
+static void unlinkCommand(ATCommandQueue *p_queue, ATCommand *p_cmd)
+{
+    ATCommand **pp_cur;
+    ATCommand *p_prev = NULL;
+
+    for (pp_cur = &p_queue->p_head ; *pp_cur != NULL
+            ; p_prev = *pp_cur, pp_cur = &(*pp_cur)->p_next) {
+        if (*pp_cur == p_cmd) {
+            *pp_cur = p_cmd->p_next;
+            if (p_queue->p_tail == p_cmd) {
+                p_queue->p_tail = p_prev;
+            }
+            p_queue->count--;
+            break;
+        }
+    }
+
+    p_cmd->p_next = NULL;
+}
+
+/**
+ * Arms s_timerfd for the earliest deadline of the in-flight commands
+ * assumes s_commandmutex is held
+ */
+static void armCommandTimer()
+{
+    ATCommand *p_cur;
+    long long earliest = 0;
+    long long msec;
+    int i;
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        for (p_cur = s_channels[i].inFlight.p_head ; p_cur != NULL
+                ; p_cur = p_cur->p_next) {
+            if (p_cur->deadline != 0
+                && (earliest == 0 || p_cur->deadline < earliest)) {
+                earliest = p_cur->deadline;
+            }
+        }
+
+        if (s_channels[i].swallowDeadline != 0
+            && (earliest == 0 || s_channels[i].swallowDeadline < earliest)) {
+            earliest = s_channels[i].swallowDeadline;
+        }
+    }
 
-    p_new = (ATLine  *) malloc(sizeof(ATLine));
+    if (earliest == 0) {
+        setCommandTimer(0);
+        return;
+    }
 
-    p_new->line = strdup(line);
+    msec = earliest - monotonicMsec();
 
-    /* note: this adds to the head of the list, so the list
-       will be in reverse order of lines received. the order is flipped
-       again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    /* 0 would disarm the timer */
+    setCommandTimer(msec > 0 ? msec : 1);
 }
 
+/**
+ * copies the part of command that identifies it for the response time
+ * statistics: the name up to and including any "=" or "?" (so that
+ * tests, reads and sets are told apart), or "ATx" for basic commands
+ * returns 0 if the command has no usable name
+ */
+static int getCommandName(const char *command, char *name, size_t size)
+{
+    size_t len;
+
+    if (!strStartsWith(command, "AT") || command[2] == '\0') {
+        return 0;
+    }
+
+    if (command[2] != '+' && command[2] != '%' && command[2] != '$') {
+        len = 3;
+    } else {
+        len = strcspn(command, "=?;");
+
+        if (command[len] == '=') {
+            len += (command[len + 1] == '?') ? 2 : 1;
+        } else if (command[len] == '?') {
+            len++;
+        }
+    }
+
+    if (len >= size) {
+        return 0;
+    }
+
+    memcpy(name, command, len);
+    name[len] = '\0';
+
+    return 1;
+}
 
 /**
- * returns 1 if line is a final response indicating error
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * returns the statistics slot for command, claiming a free one if
+ * needed, or NULL
+ * assumes s_commandmutex is held
  */
-static const char * s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
-};
-static int isFinalResponseError(const char *line)
+static ATRttStats *findRttStats(const char *command)
+{
+    char name[sizeof(s_rttStats[0].name)];
+    unsigned hash = 2166136261u;
+    const char *p;
+    unsigned i;
+    ATRttStats *p_stats;
+
+    if (!getCommandName(command, name, sizeof(name))) {
+        return NULL;
+    }
+
+    for (p = name ; *p != '\0' ; p++) {
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    }
+
+    for (i = 0 ; i < RTT_TABLE_SIZE ; i++) {
+        p_stats = &s_rttStats[(hash + i) & (RTT_TABLE_SIZE - 1)];
+
+        if (p_stats->name[0] == '\0') {
+            strcpy(p_stats->name, name);
+            return p_stats;
+        }
+
+        if (0 == strcmp(p_stats->name, name)) {
+            return p_stats;
+        }
+    }
+
+    return NULL;
+}
+
+/** assumes s_commandmutex is held */
+static void recordResponseTime(const char *command, long long msec)
+{
+    ATRttStats *p_stats = findRttStats(command);
+    int i;
+
+    if (p_stats == NULL) {
+        return;
+    }
+
+    for (i = 0 ; i < RTT_BUCKETS - 1 && msec >= (2LL << i) ; i++);
+
+    p_stats->buckets[i]++;
+    p_stats->count++;
+
+    if (p_stats->count >= RTT_MAX_SAMPLES) {
+        /* let the distribution follow the modem's current behaviour */
+        p_stats->count = 0;
+        for (i = 0 ; i < RTT_BUCKETS ; i++) {
+            p_stats->buckets[i] /= 2;
+            p_stats->count += p_stats->buckets[i];
+        }
+    }
+}
+
+/**
+ * returns the timeout for a command sent with AT_TIMEOUT_DEFAULT
+ * assumes s_commandmutex is held
+ */
+static long long getDefaultTimeout(const char *command)
 {
+    long long timeoutMsec = DEFAULT_TIMEOUT_MSEC;
+    long long adaptive;
+    ATRttStats *p_stats;
+    unsigned seen, needed;
     size_t i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
+    for (i = 0 ; i < NUM_ELEMS(s_commandTimeouts) ; i++) {
+        if (strStartsWith(command, s_commandTimeouts[i].prefix)) {
+            timeoutMsec = s_commandTimeouts[i].timeoutMsec;
+            break;
         }
     }
 
-    return 0;
+    if (!s_adaptiveTimeouts) {
+        return timeoutMsec;
+    }
+
+    p_stats = findRttStats(command);
+
+    if (p_stats == NULL || p_stats->count < RTT_MIN_SAMPLES) {
+        return timeoutMsec;
+    }
+
+    /* a margin over the upper bound of the percentile's bucket */
+    needed = (p_stats->count * RTT_PERCENTILE + 99) / 100;
+
+    for (i = 0, seen = 0 ; i < RTT_BUCKETS - 1 ; i++) {
+        seen += p_stats->buckets[i];
+        if (seen >= needed) {
+            break;
+        }
+    }
+
+    adaptive = (2LL << i) * RTT_MARGIN;
+
+    if (adaptive < MIN_ADAPTIVE_TIMEOUT_MSEC) {
+        adaptive = MIN_ADAPTIVE_TIMEOUT_MSEC;
+    }
+
+    return adaptive < timeoutMsec ? adaptive : timeoutMsec;
 }
 
 /**
- * returns 1 if line is a final response indicating success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * returns 1 if a command may be written to p_channel now
+ * a barrier command has to be the only one in flight
+ * assumes s_commandmutex is held
  */
-static const char * s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT"       /* some stacks start up data on another channel */
-};
-static int isFinalResponseSuccess(const char *line)
+static int canIssueCommand(ATChannel *p_channel, int barrier)
+{
+    if (p_channel->swallowDeadline != 0) {
+        return 0;
+    }
+
+    if (p_channel->inFlight.count == 0) {
+        return 1;
+    }
+
+    if (barrier || p_channel->inFlight.p_head->barrier) {
+        return 0;
+    }
+
+    return p_channel->inFlight.count < s_pipelineDepth;
+}
+
+/**
+ * finishes a command that is no longer on any queue. Blocking callers
+ * are woken up, async callbacks are queued for the dispatch thread
+ * assumes s_commandmutex is held
+ */
+static void completeCommand(ATCommand *p_cmd, int err)
+{
+    p_cmd->err = err;
+    p_cmd->state = CMD_DONE;
+
+    if (p_cmd->p_sharedQuery != NULL) {
+        completeSharedQuery(p_cmd);
+    }
+
+    if (p_cmd->callback != NULL) {
+        queueCompletion(p_cmd);
+    } else {
+        pthread_cond_broadcast(&s_commandcond);
+    }
+}
+
+static ATCommandPriority getPriority(const char *command)
 {
     size_t i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
+    for (i = 0 ; i < NUM_ELEMS(s_commandPriorities) ; i++) {
+        if (strStartsWith(command, s_commandPriorities[i].prefix)) {
+            return s_commandPriorities[i].priority;
         }
     }
 
-    return 0;
+    return PRIORITY_DEFAULT;
 }
 
 /**
- * returns 1 if line is a final response, either  error or success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * the class a waiting command is scheduled in; it moves up one class
+ * for every PRIORITY_AGING_MSEC it has waited, so polls are delayed
+ * by urgent traffic but never starved by it
  */
-static int isFinalResponse(const char *line)
+static int effectivePriority(const ATCommand *p_cmd, long long now)
 {
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    long long raised = (now - p_cmd->submitted) / PRIORITY_AGING_MSEC;
+
+    return raised >= p_cmd->priority ? 0 : p_cmd->priority - (int) raised;
 }
 
+/**
+ * returns the waiting command to write next: the most urgent class,
+ * then the earliest due time, then the oldest
+ * assumes s_commandmutex is held
+ */
+static ATCommand *nextWaitingCommand(ATChannel *p_channel)
+{
+    ATCommand *p_cur, *p_best = NULL;
+    long long now = monotonicMsec();
+    int bestPriority = 0, priority;
+
+    for (p_cur = p_channel->waiting.p_head ; p_cur != NULL
+            ; p_cur = p_cur->p_next) {
+        priority = effectivePriority(p_cur, now);
+
+        if (p_best == NULL || priority < bestPriority
+            || (priority == bestPriority && p_cur->due < p_best->due)
+        ) {
+            p_best = p_cur;
+            bestPriority = priority;
+        }
+    }
+
+    return p_best;
+}
 
 /**
- * returns 1 if line is the first line in (what will be) a two-line
- * SMS unsolicited response
+ * writes waiting commands in scheduling order for as long as the
+ * pipeline has room
+ * assumes s_commandmutex is held
  */
-static const char * s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
-static int isSMSUnsolicited(const char *line)
+static void issueChannelCommands(ATChannel *p_channel)
 {
-    size_t i;
+    ATCommand *p_cmd;
+    int err;
 
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
+    while ((p_cmd = nextWaitingCommand(p_channel)) != NULL
+            && canIssueCommand(p_channel, p_cmd->barrier)) {
+        unlinkCommand(&p_channel->waiting, p_cmd);
+
+        err = writeline(p_channel, p_cmd->command);
+
+        if (err < 0) {
+            completeCommand(p_cmd, err);
+            continue;
         }
+
+        enqueueCommand(&p_channel->inFlight, p_cmd);
+        p_cmd->state = CMD_IN_FLIGHT;
     }
 
-    return 0;
+    /*
+     * the modem answers in order, so a command's clock only starts
+     * once everything ahead of it has completed; the reader thread
+     * expires it via s_timerfd
+     */
+    p_cmd = p_channel->inFlight.p_head;
+
+    if (p_cmd != NULL && p_cmd->started == 0) {
+        p_cmd->started = monotonicMsec();
+
+        if (p_cmd->timeoutMsec != 0) {
+            p_cmd->deadline = p_cmd->started + p_cmd->timeoutMsec;
+        }
+    }
 }
 
+/**
+ * issues what it can on every channel and re-arms the command timer
+ * assumes s_commandmutex is held
+ */
+static void issueCommands()
+{
+    int i;
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        issueChannelCommands(&s_channels[i]);
+    }
 
-/** assumes s_commandmutex is held */
-static void handleFinalResponse(const char *line)
+    armCommandTimer();
+}
+
+/**
+ * returns the channel with the given role, or the primary channel if
+ * there is none
+ * assumes s_commandmutex is held
+ */
+static ATChannel *findChannelByRole(ATChannelRole role)
 {
-    sp_response->finalResponse = strdup(line);
+    int i;
 
-    pthread_cond_signal(&s_commandcond);
+    for (i = 1 ; i < s_channelCount ; i++) {
+        if (s_channels[i].role == role) {
+            return &s_channels[i];
+        }
+    }
+
+    return &s_channels[0];
 }
 
-static void handleUnsolicited(const char *line)
+/** returns 1 if command starts with one of the count prefixes */
+static int matchesAny(const char *command, const char **prefixes,
+                        size_t count)
 {
-    if (s_unsolHandler != NULL) {
-        s_unsolHandler(line, NULL);
+    size_t i;
+
+    for (i = 0 ; i < count ; i++) {
+        if (strStartsWith(command, prefixes[i])) {
+            return 1;
+        }
     }
+
+    return 0;
 }
 
-static void processLine(const char *line)
+/**
+ * returns the channel a command line is written to, barriers aside
+ * assumes s_commandmutex is held
+ */
+static ATChannel *routeCommandLine(const char *command)
 {
-    pthread_mutex_lock(&s_commandmutex);
+    if (matchesAny(command, s_longCommands, NUM_ELEMS(s_longCommands))) {
+        return findChannelByRole(AT_CHANNEL_LONG);
+    }
 
-    if (sp_response == NULL) {
-        /* no command pending */
-        handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
-        // See eg. TS 27.005 4.3
-        // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else switch (s_type) {
-        case NO_RESULT:
-            handleUnsolicited(line);
-            break;
-        case NUMERIC:
-            if (sp_response->p_intermediates == NULL
-                && isdigit(line[0])
-            ) {
-                addIntermediate(line);
+    if (matchesAny(command, s_unsolicitedCommands,
+                    NUM_ELEMS(s_unsolicitedCommands))) {
+        return findChannelByRole(AT_CHANNEL_UNSOLICITED);
+    }
+
+    return &s_channels[0];
+}
+
+/**
+ * returns the channel a command is written to
+ * assumes s_commandmutex is held
+ */
+static ATChannel *routeCommand(ATCommand *p_cmd)
+{
+    /* set by sendOnChannel() */
+    if (p_cmd->p_channel != NULL) {
+        return p_cmd->p_channel;
+    }
+
+    /* prompts and the +CPIN fix are handled on the primary channel */
+    if (p_cmd->barrier) {
+        return &s_channels[0];
+    }
+
+    return routeCommandLine(p_cmd->command);
+}
+
+/**
+ * interrupts the command the modem is working on if it is abortable
+ * and p_cmd is more urgent; it is requeued by handleFinalResponse()
+ * assumes s_commandmutex is held
+ */
+static void abortForCommand(ATChannel *p_channel, ATCommand *p_cmd)
+{
+    ATCommand *p_running = p_channel->inFlight.p_head;
+
+    /* with more than one in flight the character could land in the
+       next command instead */
+    if (p_running == NULL || p_channel->inFlight.count != 1
+        || p_running->aborting || p_running->aborts >= MAX_COMMAND_ABORTS
+        || p_cmd->priority >= p_running->priority
+        || !matchesAny(p_running->command, s_abortableCommands,
+                        NUM_ELEMS(s_abortableCommands))
+    ) {
+        return;
+    }
+
+    LOGI("atchannel: aborting %s for %s\n", p_running->command,
+            p_cmd->command);
+
+    if (writeAbort(p_channel) == 0) {
+        p_running->aborting = 1;
+    }
+}
+
+/**
+ * puts an aborted command back on its channel's waiting queue with a
+ * fresh response and submit time, to be written again once the urgent
+ * commands are done
+ * returns 0 on success, -1 if it has to be completed instead
+ * assumes s_commandmutex is held
+ */
+static int requeueAbortedCommand(ATCommand *p_cmd)
+{
+    ATResponse *p_response = at_response_new();
+
+    if (p_response == NULL) {
+        return -1;
+    }
+
+    at_response_free(p_cmd->p_response);
+    p_cmd->p_response = p_response;
+
+    p_cmd->aborting = 0;
+    p_cmd->aborts++;
+    p_cmd->started = 0;
+    p_cmd->deadline = 0;
+
+    /* queue it as if it was submitted now; with its old time it would
+       age past the command that aborted it and run again first */
+    p_cmd->submitted = monotonicMsec();
+    p_cmd->due = p_cmd->timeoutMsec != 0
+                    ? p_cmd->submitted + p_cmd->timeoutMsec : LLONG_MAX;
+
+    enqueueCommand(&p_cmd->p_channel->waiting, p_cmd);
+    p_cmd->state = CMD_WAITING;
+
+    return 0;
+}
+
+/** assumes s_commandmutex is held */
+static void submitCommand(ATCommand *p_cmd)
+{
+    if (p_cmd->timeoutMsec == AT_TIMEOUT_DEFAULT) {
+        p_cmd->timeoutMsec = getDefaultTimeout(p_cmd->command);
+    }
+
+    if (shareQuery(p_cmd)) {
+        return;
+    }
+
+    p_cmd->priority = getPriority(p_cmd->command);
+    p_cmd->submitted = monotonicMsec();
+    p_cmd->due = p_cmd->timeoutMsec != 0
+                    ? p_cmd->submitted + p_cmd->timeoutMsec : LLONG_MAX;
+
+    p_cmd->p_channel = routeCommand(p_cmd);
+
+    enqueueCommand(&p_cmd->p_channel->waiting, p_cmd);
+    p_cmd->state = CMD_WAITING;
+
+    abortForCommand(p_cmd->p_channel, p_cmd);
+
+    issueChannelCommands(p_cmd->p_channel);
+    armCommandTimer();
+}
+
+/**
+ * takes a command off whichever queue it is on; anything following
+ * it fails with it
+ */
+static void unlinkPendingCommand(ATCommand *p_cmd)
+{
+    ATCommand **pp_cur;
+    ATCommand *p_follower;
+
+    if (p_cmd->state == CMD_WAITING) {
+        unlinkCommand(&p_cmd->p_channel->waiting, p_cmd);
+    } else if (p_cmd->state == CMD_IN_FLIGHT) {
+        unlinkCommand(&p_cmd->p_channel->inFlight, p_cmd);
+    } else if (p_cmd->state == CMD_SHARED) {
+        for (pp_cur = &p_cmd->p_leader->p_followers ; *pp_cur != NULL
+                ; pp_cur = &(*pp_cur)->p_next) {
+            if (*pp_cur == p_cmd) {
+                *pp_cur = p_cmd->p_next;
+                break;
+            }
+        }
+    }
+
+    while ((p_follower = p_cmd->p_followers) != NULL) {
+        p_cmd->p_followers = p_follower->p_next;
+        p_follower->p_sharedQuery = NULL;
+        completeCommand(p_follower, AT_ERROR_CHANNEL_CLOSED);
+    }
+}
+
+/**
+ * completes every pending command with err
+ * assumes s_commandmutex is held
+ */
+static void failAllCommands(int err)
+{
+    ATChannel *p_channel;
+    ATCommand *p_cmd;
+    int i;
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        p_channel = &s_channels[i];
+
+        while ((p_cmd = p_channel->inFlight.p_head) != NULL) {
+            unlinkCommand(&p_channel->inFlight, p_cmd);
+            completeCommand(p_cmd, err);
+        }
+
+        while ((p_cmd = p_channel->waiting.p_head) != NULL) {
+            unlinkCommand(&p_channel->waiting, p_cmd);
+            completeCommand(p_cmd, err);
+        }
+    }
+
+    armCommandTimer();
+}
+
+#define ARENA_ALIGN(x) (((x) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/**
+ * returns len bytes of pointer-aligned storage that lives until
+ * the response is freed, or NULL if out of memory
+ */
+static void *arenaAlloc(ATResponse *p_response, size_t len)
+{
+    ATArena *p_arena = (ATArena *) p_response;
+    ATArenaChunk *p_chunk;
+    size_t size;
+    void *ret;
+
+    len = ARENA_ALIGN(len);
+
+    if (p_arena->used + len <= ARENA_SIZE) {
+        ret = p_arena->data + p_arena->used;
+        p_arena->used += len;
+        return ret;
+    }
+
+    p_chunk = p_arena->p_chunks;
+
+    if (p_chunk != NULL && p_chunk->used + len <= p_chunk->size) {
+        ret = p_chunk->data + p_chunk->used;
+        p_chunk->used += len;
+        return ret;
+    }
+
+    size = len > ARENA_SIZE ? len : ARENA_SIZE;
+
+    p_chunk = (ATArenaChunk *) malloc(sizeof(ATArenaChunk) + size);
+
+    if (p_chunk == NULL) {
+        return NULL;
+    }
+
+    p_chunk->size = size;
+    p_chunk->used = len;
+    p_chunk->p_next = p_arena->p_chunks;
+    p_arena->p_chunks = p_chunk;
+
+    return p_chunk->data;
+}
+
+/** copies line into the response's arena */
+static char *arenaStrdup(ATResponse *p_response, const char *line)
+{
+    size_t len = strlen(line) + 1;
+    char *ret;
+
+    ret = (char *) arenaAlloc(p_response, len);
+
+    if (ret != NULL) {
+        memcpy(ret, line, len);
+    }
+
+    return ret;
+}
+
+/** appends an intermediate response line to p_response */
+static void appendIntermediate(ATResponse *p_response, const char *line)
+{
+    ATLine *p_new;
+    ATArena *p_arena = (ATArena *) p_response;
+    size_t len = strlen(line) + 1;
+
+    /* the line is stored right behind its ATLine */
+    p_new = (ATLine *) arenaAlloc(p_response, sizeof(ATLine) + len);
+
+    if (p_new == NULL) {
+        LOGE("out of memory for intermediate response: %s\n", line);
+        return;
+    }
+
+    p_new->line = (char *) (p_new + 1);
+    memcpy(p_new->line, line, len);
+    p_new->p_next = NULL;
+
+    if (p_arena->p_tail == NULL) {
+        p_response->p_intermediates = p_new;
+    } else {
+        p_arena->p_tail->p_next = p_new;
+    }
+
+    p_arena->p_tail = p_new;
+}
+
+/** add an intermediate response to the oldest in-flight command */
+static void addIntermediate(ATChannel *p_channel, const char *line)
+{
+    appendIntermediate(p_channel->inFlight.p_head->p_response, line);
+}
+
+/** returns a copy of p_response in its own arena, or NULL */
+static ATResponse *cloneResponse(const ATResponse *p_response)
+{
+    ATResponse *p_clone;
+    ATLine *p_cur;
+
+    p_clone = at_response_new();
+
+    if (p_clone == NULL) {
+        return NULL;
+    }
+
+    p_clone->success = p_response->success;
+
+    if (p_response->finalResponse != NULL) {
+        p_clone->finalResponse = arenaStrdup(p_clone,
+                                                p_response->finalResponse);
+    }
+
+    for (p_cur = p_response->p_intermediates ; p_cur != NULL
+            ; p_cur = p_cur->p_next) {
+        appendIntermediate(p_clone, p_cur->line);
+    }
+
+    return p_clone;
+}
+
+/**
+ * completes the followers of a shared query with copies of its
+ * response, and keeps a copy for callers arriving shortly after
+ * assumes s_commandmutex is held
+ */
+static void completeSharedQuery(ATCommand *p_cmd)
+{
+    size_t index = p_cmd->p_sharedQuery - s_sharedQueries;
+    ATCommand *p_follower;
+    int err;
+
+    while ((p_follower = p_cmd->p_followers) != NULL) {
+        p_cmd->p_followers = p_follower->p_next;
+        err = p_cmd->err;
+
+        if (err == 0) {
+            at_response_free(p_follower->p_response);
+            p_follower->p_response = cloneResponse(p_cmd->p_response);
+
+            if (p_follower->p_response == NULL) {
+                err = AT_ERROR_GENERIC;
+            }
+        }
+
+        /* a follower has no followers of its own */
+        p_follower->p_sharedQuery = NULL;
+        completeCommand(p_follower, err);
+    }
+
+    if (p_cmd->err == 0 && p_cmd->p_response->success) {
+        at_response_free(s_sharedResults[index].p_response);
+        s_sharedResults[index].p_response = cloneResponse(p_cmd->p_response);
+        s_sharedResults[index].completed = monotonicMsec();
+        s_sharedResults[index].unsolicitedCount = s_unsolicitedCount;
+    }
+}
+
+/** returns the pending command p_cmd can follow, or NULL */
+static ATCommand *findSharedLeader(ATCommand *p_cmd)
+{
+    ATCommand *p_cur;
+    ATChannel *p_channel;
+    int i, j;
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        p_channel = &s_channels[i];
+
+        for (j = 0 ; j < 2 ; j++) {
+            p_cur = (j == 0) ? p_channel->inFlight.p_head
+                                : p_channel->waiting.p_head;
+
+            for ( ; p_cur != NULL ; p_cur = p_cur->p_next) {
+                if (p_cur->p_sharedQuery == p_cmd->p_sharedQuery
+                    && !p_cur->aborting
+                ) {
+                    return p_cur;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * answers p_cmd from an identical query that is pending or has just
+ * succeeded. returns 1 if it was, 0 if p_cmd has to be sent
+ * assumes s_commandmutex is held
+ */
+static int shareQuery(ATCommand *p_cmd)
+{
+    ATResponse *p_response;
+    ATCommand *p_leader;
+    ATCommand **pp_tail;
+    size_t i;
+
+    if (p_cmd->smsPDU != NULL) {
+        return 0;
+    }
+
+    for (i = 0 ; i < NUM_ELEMS(s_sharedQueries) ; i++) {
+        if (0 == strcmp(p_cmd->command, s_sharedQueries[i].command)
+            && p_cmd->type == s_sharedQueries[i].type
+            && p_cmd->responsePrefix != NULL
+            && 0 == strcmp(p_cmd->responsePrefix,
+                            s_sharedQueries[i].responsePrefix)
+        ) {
+            break;
+        }
+    }
+
+    if (i == NUM_ELEMS(s_sharedQueries)) {
+        /* this may change what the queries return */
+        forgetSharedResults();
+        return 0;
+    }
+
+    p_cmd->p_sharedQuery = &s_sharedQueries[i];
+
+    if (s_sharedResults[i].p_response != NULL
+        && s_sharedResults[i].unsolicitedCount == s_unsolicitedCount
+        && monotonicMsec() - s_sharedResults[i].completed
+            < SHARED_QUERY_WINDOW_MSEC
+    ) {
+        p_response = cloneResponse(s_sharedResults[i].p_response);
+
+        if (p_response != NULL) {
+            at_response_free(p_cmd->p_response);
+            p_cmd->p_response = p_response;
+            p_cmd->p_sharedQuery = NULL;
+            completeCommand(p_cmd, 0);
+            return 1;
+        }
+    }
+
+    p_leader = findSharedLeader(p_cmd);
+
+    if (p_leader == NULL) {
+        return 0;
+    }
+
+    /* followers complete in the order they arrived */
+    for (pp_tail = &p_leader->p_followers ; *pp_tail != NULL
+            ; pp_tail = &(*pp_tail)->p_next);
+
+    p_cmd->p_leader = p_leader;
+    p_cmd->p_next = NULL;
+    *pp_tail = p_cmd;
+    p_cmd->state = CMD_SHARED;
+
+    return 1;
+}
+
+/** assumes s_commandmutex is held */
+static void forgetSharedResults()
+{
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(s_sharedResults) ; i++) {
+        at_response_free(s_sharedResults[i].p_response);
+        s_sharedResults[i].p_response = NULL;
+    }
+}
+
+
+/**
+ * final responses indicating error
+ * See 27.007 annex B
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+static const char * s_finalResponsesError[] = {
+    "ERROR",
+    "+CMS ERROR:",
+    "+CME ERROR:",
+    "NO CARRIER", /* sometimes! */
+    "NO ANSWER",
+    "NO DIALTONE",
+    "ABORTED",    /* some stacks, after an abort character */
+};
+
+/**
+ * final responses indicating success
+ * See 27.007 annex B
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+static const char * s_finalResponsesSuccess[] = {
+    "OK",
+    "CONNECT"       /* some stacks start up data on another channel */
+};
+
+/**
+ * first lines of (what will be) two-line SMS unsolicited responses
+ */
+static const char * s_smsUnsoliciteds[] = {
+    "+CMT:",
+    "+CDS:",
+    "+CBM:"
+};
+
+/*
+ * the tables above are compiled into a prefix trie the first time a
+ * line is classified, so each line is matched in one pass over its
+ * first few bytes regardless of how many prefixes there are
+ */
+#define MAX_CLASSIFIER_NODES 128
+
+typedef enum {
+    LINE_OTHER = 0,
+    LINE_FINAL_SUCCESS,
+    LINE_FINAL_ERROR,
+    LINE_SMS_UNSOLICITED
+} ATLineClass;
+
+typedef struct {
+    unsigned char next[128];    /* child per 7-bit character, 0 for none */
+    unsigned char lineClass;    /* != LINE_OTHER if a prefix ends here */
+} ATClassifierNode;
+
+static ATClassifierNode s_classifier[MAX_CLASSIFIER_NODES];
+static int s_classifierCount = 1; /* node 0 is the root */
+static pthread_once_t s_classifierOnce = PTHREAD_ONCE_INIT;
+
+static void addClassifierPrefixes(const char **prefixes, size_t count,
+                                    ATLineClass lineClass)
+{
+    size_t i;
+    const unsigned char *p;
+    int node;
+
+    for (i = 0 ; i < count ; i++) {
+        node = 0;
+
+        for (p = (const unsigned char *) prefixes[i]; *p != '\0'; p++) {
+            if (*p >= 128) {
+                LOGE("classifier: non-ASCII prefix %s\n", prefixes[i]);
+                break;
+            }
+
+            if (s_classifier[node].next[*p] == 0) {
+                if (s_classifierCount == MAX_CLASSIFIER_NODES) {
+                    LOGE("classifier: too many prefixes, %s ignored\n",
+                            prefixes[i]);
+                    break;
+                }
+                s_classifier[node].next[*p] = s_classifierCount++;
+            }
+
+            node = s_classifier[node].next[*p];
+        }
+
+        if (*p == '\0') {
+            s_classifier[node].lineClass = lineClass;
+        }
+    }
+}
+
+static void buildClassifier()
+{
+    addClassifierPrefixes(s_finalResponsesSuccess,
+            NUM_ELEMS(s_finalResponsesSuccess), LINE_FINAL_SUCCESS);
+    addClassifierPrefixes(s_finalResponsesError,
+            NUM_ELEMS(s_finalResponsesError), LINE_FINAL_ERROR);
+    addClassifierPrefixes(s_smsUnsoliciteds,
+            NUM_ELEMS(s_smsUnsoliciteds), LINE_SMS_UNSOLICITED);
+}
+
+/** returns the class of the first table prefix that line starts with */
+static ATLineClass classifyLine(const char *line)
+{
+    const unsigned char *p = (const unsigned char *) line;
+    int node = 0;
+
+    pthread_once(&s_classifierOnce, buildClassifier);
+
+    for (;;) {
+        if (s_classifier[node].lineClass != LINE_OTHER) {
+            return (ATLineClass) s_classifier[node].lineClass;
+        }
+
+        if (*p == '\0' || *p >= 128) {
+            return LINE_OTHER;
+        }
+
+        node = s_classifier[node].next[*p++];
+
+        if (node == 0) {
+            return LINE_OTHER;
+        }
+    }
+}
+
+
+/**
+ * completes the oldest in-flight command
+ * assumes s_commandmutex is held
+ */
+static void handleFinalResponse(ATChannel *p_channel, const char *line)
+{
+    ATCommand *p_cmd = p_channel->inFlight.p_head;
+
+    p_cmd->p_response->finalResponse = arenaStrdup(p_cmd->p_response, line);
+
+    if (p_cmd->p_response->finalResponse == NULL) {
+        /* the waiter still needs a non-NULL final response */
+        p_cmd->p_response->finalResponse = (char *) "ERROR";
+    }
+
+    unlinkCommand(&p_channel->inFlight, p_cmd);
+
+    /* an abort that crossed with a complete answer is ignored */
+    if (p_cmd->aborting && !(p_cmd->p_response->success
+                                && p_cmd->p_response->p_intermediates != NULL)
+        && requeueAbortedCommand(p_cmd) == 0
+    ) {
+        issueChannelCommands(p_channel);
+        armCommandTimer();
+        return;
+    }
+
+    if (p_cmd->started != 0) {
+        recordResponseTime(p_cmd->command, monotonicMsec() - p_cmd->started);
+    }
+
+    completeCommand(p_cmd, 0);
+
+    /* a pipeline slot has opened up */
+    issueChannelCommands(p_channel);
+    armCommandTimer();
+}
+
+static void signalDispatcher()
+{
+    uint64_t one = 1;
+
+    if (write(s_dispatchfd, &one, sizeof(one)) < 0) {
+        LOGE("atchannel: unable to wake dispatcher %s", strerror(errno));
+    }
+}
+
+/**
+ * queues an entry for the dispatch thread
+ * the reader batches its wakeups, see wakeDispatcher()
+ */
+static void queueDispatch(ATDispatchEntry *p_entry)
+{
+    unsigned head = s_dispatchHead;
+    int onReader = pthread_equal(s_tid_reader, pthread_self());
+
+    p_entry->p_next = NULL;
+
+    /* once anything has spilled, keep spilling so that order is kept */
+    if (onReader && s_dispatchOverflowCount == 0
+        && head - s_dispatchTail < DISPATCH_RING_SIZE
+    ) {
+        s_dispatchRing[head & (DISPATCH_RING_SIZE - 1)] = p_entry;
+        /* publish the slot before the index */
+        __sync_synchronize();
+        s_dispatchHead = head + 1;
+        s_dispatchPending = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&s_dispatchMutex);
+
+    /* completions are never dropped, someone is waiting for them */
+    if (p_entry->p_cmd == NULL
+        && s_dispatchOverflowCount >= MAX_DISPATCH_OVERFLOW
+    ) {
+        LOGE("unsolicited queue full, dropping: %s\n", p_entry->line);
+        free(p_entry);
+        p_entry = NULL;
+    } else {
+        if (sp_dispatchOverflowTail == NULL) {
+            sp_dispatchOverflowHead = p_entry;
+        } else {
+            sp_dispatchOverflowTail->p_next = p_entry;
+        }
+        sp_dispatchOverflowTail = p_entry;
+        s_dispatchOverflowCount++;
+    }
+
+    pthread_mutex_unlock(&s_dispatchMutex);
+
+    if (p_entry == NULL) {
+        return;
+    }
+
+    if (onReader) {
+        s_dispatchPending = 1;
+    } else {
+        signalDispatcher();
+    }
+}
+
+/**
+ * hands a copy of an unsolicited response to the dispatch thread
+ * called on the reader thread
+ */
+static void queueUnsolicited(const char *line, const char *smsPdu)
+{
+    ATDispatchEntry *p_entry;
+    size_t lineLen = strlen(line) + 1;
+    size_t pduLen = (smsPdu != NULL) ? strlen(smsPdu) + 1 : 0;
+
+    /* shared query results from before this may be stale */
+    s_unsolicitedCount++;
+
+    if (s_unsolHandler == NULL) {
+        return;
+    }
+
+    p_entry = (ATDispatchEntry *) malloc(sizeof(ATDispatchEntry)
+                                        + lineLen + pduLen);
+
+    if (p_entry == NULL) {
+        LOGE("out of memory, dropping unsolicited: %s\n", line);
+        return;
+    }
+
+    p_entry->p_cmd = NULL;
+    p_entry->line = (char *) (p_entry + 1);
+    memcpy(p_entry->line, line, lineLen);
+    p_entry->smsPdu = NULL;
+
+    if (smsPdu != NULL) {
+        p_entry->smsPdu = p_entry->line + lineLen;
+        memcpy(p_entry->smsPdu, smsPdu, pduLen);
+    }
+
+    queueDispatch(p_entry);
+}
+
+/**
+ * hands a completed async command to the dispatch thread
+ * assumes s_commandmutex is held
+ */
+static void queueCompletion(ATCommand *p_cmd)
+{
+    p_cmd->completion.p_cmd = p_cmd;
+    p_cmd->completion.line = NULL;
+    p_cmd->completion.smsPdu = NULL;
+
+    queueDispatch(&p_cmd->completion);
+}
+
+static void handleUnsolicited(const char *line)
+{
+    queueUnsolicited(line, NULL);
+}
+
+/**
+ * returns the oldest dispatch entry, or NULL
+ * called on the dispatch thread
+ */
+static ATDispatchEntry *dequeueDispatch()
+{
+    ATDispatchEntry *p_entry;
+    unsigned tail = s_dispatchTail;
+
+    /* ring entries are always older than spilled ones */
+    if (tail != s_dispatchHead) {
+        /* read the index before the slot */
+        __sync_synchronize();
+        p_entry = s_dispatchRing[tail & (DISPATCH_RING_SIZE - 1)];
+        /* done with the slot before handing it back */
+        __sync_synchronize();
+        s_dispatchTail = tail + 1;
+        return p_entry;
+    }
+
+    pthread_mutex_lock(&s_dispatchMutex);
+
+    p_entry = sp_dispatchOverflowHead;
+
+    if (p_entry != NULL) {
+        sp_dispatchOverflowHead = p_entry->p_next;
+        if (sp_dispatchOverflowHead == NULL) {
+            sp_dispatchOverflowTail = NULL;
+        }
+        s_dispatchOverflowCount--;
+    }
+
+    pthread_mutex_unlock(&s_dispatchMutex);
+
+    return p_entry;
+}
+
+/** wakes the dispatch thread if the reader queued anything */
+static void wakeDispatcher()
+{
+    if (!s_dispatchPending) {
+        return;
+    }
+
+    s_dispatchPending = 0;
+
+    signalDispatcher();
+}
+
+/**
+ * runs the callback of an async command and frees it
+ * called on the dispatch thread
+ */
+static void runCompletion(ATCommand *p_cmd)
+{
+    ATResponse *p_response = p_cmd->p_response;
+    int err = p_cmd->err;
+
+    if (err == 0
+        && (p_cmd->type == SINGLELINE || p_cmd->type == NUMERIC)
+        && p_response->success > 0
+        && p_response->p_intermediates == NULL
+    ) {
+        /* successful command must have an intermediate response */
+        err = AT_ERROR_INVALID_RESPONSE;
+    }
+
+    if (err < 0) {
+        at_response_free(p_response);
+        p_response = NULL;
+    }
+
+    p_cmd->callback(err, p_response, p_cmd->param);
+
+    at_response_free(p_response);
+    free(p_cmd);
+}
+
+static void *dispatchLoop(void *arg)
+{
+    ATDispatchEntry *p_entry;
+    uint64_t count;
+
+    for (;;) {
+        while ((p_entry = dequeueDispatch()) != NULL) {
+            if (p_entry->p_cmd != NULL) {
+                /* the entry is part of the command */
+                runCompletion(p_entry->p_cmd);
+            } else {
+                s_unsolHandler(p_entry->line, p_entry->smsPdu);
+                free(p_entry);
+            }
+        }
+
+        if (s_dispatcherStop) {
+            break;
+        }
+
+        if (read(s_dispatchfd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            LOGE("atchannel: dispatcher read failed %s", strerror(errno));
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&s_dispatchMutex);
+    s_dispatcherRunning = 0;
+    pthread_cond_broadcast(&s_dispatcherExitCond);
+    pthread_mutex_unlock(&s_dispatchMutex);
+
+    return NULL;
+}
+
+/**
+ * returns 1 if line is an intermediate response of p_command;
+ * p_response, if not NULL, holds the lines it already has
+ */
+static int batchCommandAccepts(const ATBatchCommand *p_command,
+                                const ATResponse *p_response,
+                                const char *line)
+{
+    int empty = p_response == NULL || p_response->p_intermediates == NULL;
+
+    switch (p_command->type) {
+        case NUMERIC:
+            return empty && isdigit(line[0]);
+        case SINGLELINE:
+            return empty && strStartsWith(line, p_command->responsePrefix);
+        case MULTILINE:
+            return strStartsWith(line, p_command->responsePrefix);
+        default:
+            return 0;
+    }
+}
+
+/** returns 1 if line is an intermediate response of any command */
+static int batchAccepts(const ATBatchCommand *p_batch, int count,
+                        const char *line)
+{
+    int i;
+
+    for (i = 0 ; i < count ; i++) {
+        if (batchCommandAccepts(&p_batch[i], NULL, line)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void processLine(ATChannel *p_channel, const char *line,
+                        ATLineClass lineClass)
+{
+    ATCommand *p_cmd;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    p_cmd = p_channel->inFlight.p_head;
+
+    if (p_channel->swallowDeadline != 0 && p_cmd == NULL
+        && (lineClass == LINE_FINAL_SUCCESS || lineClass == LINE_FINAL_ERROR)
+    ) {
+        /* the real final response of a +CPIN completed early */
+        p_channel->swallowDeadline = 0;
+        issueChannelCommands(p_channel);
+        armCommandTimer();
+    } else if (p_cmd == NULL) {
+        /* no command pending */
+        handleUnsolicited(line);
+    } else if (lineClass == LINE_FINAL_SUCCESS) {
+        p_cmd->p_response->success = 1;
+        handleFinalResponse(p_channel, line);
+    } else if (lineClass == LINE_FINAL_ERROR) {
+        p_cmd->p_response->success = 0;
+        handleFinalResponse(p_channel, line);
+    } else if (p_cmd->smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        // See eg. TS 27.005 4.3
+        // Commands like AT+CMGS have a "> " prompt
+        writeCtrlZ(p_channel, p_cmd->smsPDU);
+        p_cmd->smsPDU = NULL;
+    } else if (p_cmd->p_batch != NULL) {
+        /* split up between the commands by at_send_batch() */
+        if (batchAccepts(p_cmd->p_batch, p_cmd->batchCount, line)) {
+            addIntermediate(p_channel, line);
+        } else {
+            handleUnsolicited(line);
+        }
+    } else switch (p_cmd->type) {
+        case NO_RESULT:
+            handleUnsolicited(line);
+            break;
+        case NUMERIC:
+            if (p_cmd->p_response->p_intermediates == NULL
+                && isdigit(line[0])
+            ) {
+                addIntermediate(p_channel, line);
             } else {
                 /* either we already have an intermediate response or
                    the line doesn't begin with a digit */
@@ -275,14 +1860,17 @@ static void processLine(const char *line)
             }
             break;
         case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith (line, s_responsePrefix)
+            if (p_cmd->p_response->p_intermediates == NULL
+                && strStartsWith (line, p_cmd->responsePrefix)
             ) {
-                addIntermediate(line);
-		if (strStartsWith("+CPIN:",s_responsePrefix)){
+                addIntermediate(p_channel, line);
+		if (0 == strcmp(p_cmd->responsePrefix, "+CPIN:")) {
 			LOGI("######## USING AT COMMAND +CPIN FIX FOR SIERRA WIRELESS");
-			sp_response->success = 1;
-			handleFinalResponse("OK");
+			p_cmd->p_response->success = 1;
+			/* keeps the channel blocked until the real OK is read */
+			p_channel->swallowDeadline = monotonicMsec()
+			        + CPIN_FINAL_TIMEOUT_MSEC;
+			handleFinalResponse(p_channel, "OK");
 		}
             } else {
                 /* we already have an intermediate response */
@@ -290,220 +1878,411 @@ static void processLine(const char *line)
             }
             break;
         case MULTILINE:
-            if (strStartsWith (line, s_responsePrefix)) {
-                addIntermediate(line);
+            if (strStartsWith (line, p_cmd->responsePrefix)) {
+                addIntermediate(p_channel, line);
             } else {
                 handleUnsolicited(line);
             }
         break;
 
-        default: /* this should never be reached */
-            LOGE("Unsupported AT command type %d\n", s_type);
-            handleUnsolicited(line);
-        break;
+        default: /* this should never be reached */
+            LOGE("Unsupported AT command type %d\n", p_cmd->type);
+            handleUnsolicited(line);
+        break;
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+
+/**
+ * Reads whatever is available on the AT channel into the framer
+ * Returns the number of bytes read, 0 if the read would block and
+ * -1 on EOF or error
+ */
+static int readChunk(ATChannel *p_channel)
+{
+    int count;
+
+    count = at_framer_read(&p_channel->framer, p_channel->fd);
+
+    /* the power control handshake is on the primary tty */
+    if (count > 0 && p_channel == &s_channels[0]) {
+        s_readCount += count;
+    }
+
+    return count;
+}
+
+/**
+ * Returns the next complete line from the input buffer, or NULL if
+ * more input has to be read first. Never blocks.
+ *
+ * This line is valid only until the next call to readline or readChunk
+ */
+static const char *readline(ATChannel *p_channel)
+{
+    const char *ret;
+
+    ret = at_framer_next_line(&p_channel->framer);
+
+    if (ret != NULL) {
+        LOGD("AT< %s\n", ret);
+    }
+
+    return ret;
+}
+
+
+static void onReaderClosed()
+{
+    if (s_onReaderClosed != NULL && s_readerClosed == 0) {
+
+        pthread_mutex_lock(&s_commandmutex);
+
+        s_readerClosed = 1;
+
+        failAllCommands(AT_ERROR_CHANNEL_CLOSED);
+
+        pthread_cond_broadcast(&s_commandcond);
+
+        pthread_mutex_unlock(&s_commandmutex);
+
+        wakeDispatcher();
+
+        s_onReaderClosed();
+    }
+}
+
+
+/** hands every complete line in the input buffer to processLine() */
+static void processLines(ATChannel *p_channel)
+{
+    const char *line;
+    ATLineClass lineClass;
+
+    while ((line = readline(p_channel)) != NULL) {
+        if (p_channel->smsUnsolLine != NULL) {
+            /* line is the PDU that goes with the previous line */
+            queueUnsolicited(p_channel->smsUnsolLine, line);
+            free(p_channel->smsUnsolLine);
+            p_channel->smsUnsolLine = NULL;
+            continue;
+        }
+
+        lineClass = classifyLine(line);
+
+        if (lineClass == LINE_SMS_UNSOLICITED) {
+            // The scope of string returned by 'readline()' is valid only
+            // till next call to 'readline()' hence making a copy of line
+            // before calling readline again.
+            p_channel->smsUnsolLine = strdup(line);
+        } else {
+            processLine(p_channel, line, lineClass);
+        }
+    }
+
+    wakeDispatcher();
+}
+
+/**
+ * called on the reader thread when s_timerfd fires
+ * fails every in-flight command whose deadline has passed, along with
+ * the ones behind it on its channel, since the late final response would
+ * complete the next one. A blocking caller reports its timeout itself;
+ * for an async one nobody would, so s_onTimeout is called from here
+ * returns -1 if s_onTimeout was called and the reader has to stop
+ */
+static int onCommandTimer()
+{
+    uint64_t expirations;
+    ATCommand *p_cur;
+    long long now;
+    int asyncTimeout = 0;
+    int i;
+
+    /* nothing to do if the timer was re-armed since it fired */
+    if (read(s_timerfd, &expirations, sizeof(expirations)) < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    now = monotonicMsec();
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        if (s_channels[i].swallowDeadline != 0
+            && now >= s_channels[i].swallowDeadline
+        ) {
+            LOGI("atchannel: no final response after +CPIN; going on");
+            s_channels[i].swallowDeadline = 0;
+        }
+
+        for (p_cur = s_channels[i].inFlight.p_head ; p_cur != NULL
+                ; p_cur = p_cur->p_next) {
+            if (p_cur->deadline != 0 && now >= p_cur->deadline) {
+                break;
+            }
+        }
+
+        while (p_cur != NULL) {
+            ATCommand *p_next = p_cur->p_next;
+
+            asyncTimeout |= p_cur->callback != NULL;
+
+            unlinkCommand(&s_channels[i].inFlight, p_cur);
+            completeCommand(p_cur, AT_ERROR_TIMEOUT);
+
+            p_cur = p_next;
+        }
+    }
+
+    if (!asyncTimeout || s_onTimeout == NULL) {
+        /* also re-arms the timer */
+        issueCommands();
     }
 
     pthread_mutex_unlock(&s_commandmutex);
-}
 
+    wakeDispatcher();
 
-/**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
- *
- * returns NULL if there is no complete line
- */
-static char * findNextEOL(char *cur)
-{
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
+    if (asyncTimeout && s_onTimeout != NULL) {
+        s_onTimeout();
+        return -1;
     }
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
-
-    return *cur == '\0' ? NULL : cur;
+    return 0;
 }
 
-
-/**
- * Reads a line from the AT channel, returns NULL on timeout.
- * Assumes it has exclusive read access to the FD
- *
- * This line is valid only until the next call to readline
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
- */
-
-static const char *readline()
+/** returns the channel reading from fd, or NULL */
+static ATChannel *findChannel(int fd)
 {
-    ssize_t count;
-
-    char *p_read = NULL;
-    char *p_eol = NULL;
-    char *ret;
-
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
+    int i;
 
-        // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
+    for (i = 0 ; i < s_channelCount ; i++) {
+        if (s_channels[i].fd == fd) {
+            return &s_channels[i];
+        }
+    }
 
-        p_eol = findNextEOL(s_ATBufferCur);
+    return NULL;
+}
 
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+static void *readerLoop(void *arg)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    ATChannel *p_channel;
+    int n, i;
 
-            len = strlen(s_ATBufferCur);
+    for (;;) {
+        n = epoll_wait(s_epfd, events, MAX_EPOLL_EVENTS, -1);
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("atchannel: epoll_wait failed %s", strerror(errno));
+            goto out;
         }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
-    }
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            LOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
-        }
+        for (i = 0 ; i < n ; i++) {
+            if (events[i].data.fd == s_wakefd) {
+                /* at_close() was called */
+                goto out;
+            } else if (events[i].data.fd == s_timerfd) {
+                if (onCommandTimer() < 0) {
+                    goto out;
+                }
+            } else if ((p_channel = findChannel(events[i].data.fd)) != NULL) {
+                if (events[i].events & EPOLLOUT) {
+                    pthread_mutex_lock(&s_commandmutex);
+                    drainOutputQueue(p_channel);
+                    pthread_mutex_unlock(&s_commandmutex);
+                }
+
+                if ((events[i].events & ~EPOLLOUT) == 0) {
+                    continue;
+                }
+
+                /* epoll is level triggered, so anything left over
+                   will wake us up again. Losing any one channel
+                   closes them all */
+                if (readChunk(p_channel) < 0) {
+                    goto out;
+                }
+
+                processLines(p_channel);
 
-        do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
-        } while (count < 0 && errno == EINTR);
-
-        if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
-            s_readCount += count;
-
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
-
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
-            /* read error encountered or EOF reached */
-            if(count == 0) {
-                LOGD("atchannel: EOF reached");
-            } else {
-                LOGD("atchannel: read error %s", strerror(errno));
+#ifdef HAVE_ANDROID_OS
+                if (s_ackPowerIoctl > 0 && p_channel == &s_channels[0]) {
+                    /* acknowledge that bytes have been read and processed */
+                    ioctl(p_channel->fd, OMAP_CSMI_TTY_ACK, &s_readCount);
+                    s_readCount = 0;
+                }
+#endif /*HAVE_ANDROID_OS*/
             }
-            return NULL;
         }
     }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
+out:
+    for (i = 0 ; i < s_channelCount ; i++) {
+        free(s_channels[i].smsUnsolLine);
+        s_channels[i].smsUnsolLine = NULL;
+    }
+
+    onReaderClosed();
 
-    ret = s_ATBufferCur;
-    *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+    pthread_mutex_lock(&s_commandmutex);
+    s_readerThreadRunning = 0;
+    pthread_cond_broadcast(&s_readerExitCond);
+    pthread_mutex_unlock(&s_commandmutex);
 
-    LOGD("AT< %s\n", ret);
-    return ret;
+    return NULL;
 }
 
+/** asks epoll to (also) report when the channel's fd becomes writable */
+static void setWriteInterest(ATChannel *p_channel, int enable)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+    ev.data.fd = p_channel->fd;
 
-static void onReaderClosed()
+    if (epoll_ctl(s_epfd, EPOLL_CTL_MOD, p_channel->fd, &ev) < 0) {
+        LOGE("atchannel: unable to update epoll %s", strerror(errno));
+    }
+}
+
+/**
+ * appends whatever is left of iov after the first "skip" bytes
+ * to the output queue
+ * assumes s_commandmutex is held
+ */
+static int queueOutput(ATChannel *p_channel, const struct iovec *iov,
+                        int iovcnt, size_t skip)
 {
-    if (s_onReaderClosed != NULL && s_readerClosed == 0) {
+    size_t total = 0;
+    int i;
 
-        pthread_mutex_lock(&s_commandmutex);
+    for (i = 0 ; i < iovcnt ; i++) {
+        total += iov[i].iov_len;
+    }
 
-        s_readerClosed = 1;
+    if (p_channel->outQueueLen + total - skip > OUTPUT_QUEUE_SIZE) {
+        LOGE("atchannel: output queue full, dropping command\n");
+        return AT_ERROR_GENERIC;
+    }
 
-        pthread_cond_signal(&s_commandcond);
+    if (p_channel->outQueueLen == 0) {
+        setWriteInterest(p_channel, 1);
+    }
 
-        pthread_mutex_unlock(&s_commandmutex);
+    for (i = 0 ; i < iovcnt ; i++) {
+        const char *base = (const char *) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
 
-        s_onReaderClosed();
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        memcpy(p_channel->outQueue + p_channel->outQueueLen,
+                base + skip, len - skip);
+        p_channel->outQueueLen += len - skip;
+        skip = 0;
     }
-}
 
+    return 0;
+}
 
-static void *readerLoop(void *arg)
+/**
+ * writes as much of the output queue as the fd will take
+ * called on the reader thread when the channel's fd is writable
+ * assumes s_commandmutex is held
+ */
+static void drainOutputQueue(ATChannel *p_channel)
 {
-    for (;;) {
-        const char * line;
+    ssize_t written;
 
-        line = readline();
+    if (p_channel->outQueueLen == 0) {
+        setWriteInterest(p_channel, 0);
+        return;
+    }
 
-        if (line == NULL) {
-            break;
-        }
+    do {
+        written = write(p_channel->fd, p_channel->outQueue,
+                        p_channel->outQueueLen);
+    } while (written < 0 && errno == EINTR);
 
-        if(isSMSUnsolicited(line)) {
-            char *line1;
-            const char *line2;
+    if (written < 0 && errno == EAGAIN) {
+        return;
+    }
 
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
-            line2 = readline();
+    if (written < 0) {
+        /* pending commands will time out or see the channel close */
+        LOGE("atchannel: write failed %s", strerror(errno));
+        written = p_channel->outQueueLen;
+    }
 
-            if (line2 == NULL) {
-                break;
-            }
+    p_channel->outQueueLen -= written;
+    memmove(p_channel->outQueue, p_channel->outQueue + written,
+            p_channel->outQueueLen);
 
-            if (s_unsolHandler != NULL) {
-                s_unsolHandler (line1, line2);
-            }
-            free(line1);
-        } else {
-            processLine(line);
-        }
+    if (p_channel->outQueueLen == 0) {
+        setWriteInterest(p_channel, 0);
+    }
+}
 
-#ifdef HAVE_ANDROID_OS
-        if (s_ackPowerIoctl > 0) {
-            /* acknowledge that bytes have been read and processed */
-            ioctl(s_fd, OMAP_CSMI_TTY_ACK, &s_readCount);
-            s_readCount = 0;
+/**
+ * sends s followed by the one byte terminator in a single writev(),
+ * queueing whatever the tty does not accept right away
+ * assumes s_commandmutex is held
+ */
+static int writeFrame(ATChannel *p_channel, const char *s,
+                        const char *terminator)
+{
+    struct iovec iov[2];
+    ssize_t written;
+
+    iov[0].iov_base = (void *) s;
+    iov[0].iov_len = strlen(s);
+    iov[1].iov_base = (void *) terminator;
+    iov[1].iov_len = 1;
+
+    if (p_channel->outQueueLen > 0) {
+        /* keep frames in order behind the ones already waiting */
+        return queueOutput(p_channel, iov, 2, 0);
+    }
+
+    do {
+        written = writev(p_channel->fd, iov, 2);
+    } while (written < 0 && errno == EINTR);
+
+    if (written < 0) {
+        if (errno != EAGAIN) {
+            return AT_ERROR_GENERIC;
         }
-#endif /*HAVE_ANDROID_OS*/
+        written = 0;
     }
 
-    onReaderClosed();
+    if ((size_t) written < iov[0].iov_len + iov[1].iov_len) {
+        return queueOutput(p_channel, iov, 2, written);
+    }
 
-    return NULL;
+    return 0;
 }
 
 /**
  * Sends string s to the radio with a \r appended.
  * Returns AT_ERROR_* on error, 0 on success
  *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * Output the tty cannot take yet is queued and sent by the reader
+ * thread, so this never blocks.
  */
-static int writeline (const char *s)
+static int writeline (ATChannel *p_channel, const char *s)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
-
-    if (s_fd < 0 || s_readerClosed > 0) {
+    if (p_channel->fd < 0 || s_readerClosed > 0) {
         return AT_ERROR_CHANNEL_CLOSED;
     }
 
@@ -511,100 +2290,138 @@ static int writeline (const char *s)
 
     AT_DUMP( ">> ", s, strlen(s) );
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write (s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
-
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
-        }
+    return writeFrame(p_channel, s, "\r");
+}
 
-        cur += written;
+static int writeCtrlZ (ATChannel *p_channel, const char *s)
+{
+    if (p_channel->fd < 0 || s_readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
     }
 
-    /* the \r  */
-
-    do {
-        written = write (s_fd, "\r" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+    LOGD("AT> %s^Z\n", s);
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
-    }
+    AT_DUMP( ">* ", s, strlen(s) );
 
-    return 0;
+    return writeFrame(p_channel, s, "\032");
 }
-static int writeCtrlZ (const char *s)
-{
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
 
-    if (s_fd < 0 || s_readerClosed > 0) {
+/**
+ * sends the character that aborts the command being executed; a bare
+ * CR, which an idle modem ignores if the command has finished already
+ */
+static int writeAbort (ATChannel *p_channel)
+{
+    if (p_channel->fd < 0 || s_readerClosed > 0) {
         return AT_ERROR_CHANNEL_CLOSED;
     }
 
-    LOGD("AT> %s^Z\n", s);
+    LOGD("AT> (abort)\n");
 
-    AT_DUMP( ">* ", s, strlen(s) );
+    return writeFrame(p_channel, "", "\r");
+}
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write (s_fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+static int addEpollFd(int fd)
+{
+    struct epoll_event ev;
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
-        }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
 
-        cur += written;
-    }
+    return epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-    /* the ^Z  */
+/** assumes s_commandmutex is held */
+static void initChannel(ATChannel *p_channel, int fd, ATChannelRole role)
+{
+    p_channel->fd = fd;
+    p_channel->role = role;
+    p_channel->smsUnsolLine = NULL;
+    p_channel->outQueueLen = 0;
+    p_channel->swallowDeadline = 0;
 
-    do {
-        written = write (s_fd, "\032" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+    memset(&p_channel->waiting, 0, sizeof(p_channel->waiting));
+    memset(&p_channel->inFlight, 0, sizeof(p_channel->inFlight));
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
-    }
+    at_framer_init(&p_channel->framer);
 
-    return 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-static void clearPendingCommand()
+static void closeReaderFds()
 {
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
+    if (s_epfd >= 0) {
+        close(s_epfd);
+    }
+    if (s_wakefd >= 0) {
+        close(s_wakefd);
+    }
+    if (s_timerfd >= 0) {
+        close(s_timerfd);
     }
 
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
+    if (s_dispatchfd >= 0) {
+        close(s_dispatchfd);
+    }
+
+    s_epfd = -1;
+    s_wakefd = -1;
+    s_timerfd = -1;
+    s_dispatchfd = -1;
 }
 
+/**
+ * lets the dispatch thread deliver whatever is still queued, then
+ * waits for it to exit
+ */
+static void stopDispatcher()
+{
+    s_dispatcherStop = 1;
+    __sync_synchronize();
+
+    signalDispatcher();
+
+    if (0 != pthread_equal(s_tid_dispatcher, pthread_self())) {
+        /* at_close() called from a handler or callback */
+        pthread_detach(s_tid_dispatcher);
+    } else {
+        pthread_join(s_tid_dispatcher, NULL);
+    }
+}
 
 /**
  * Starts AT handler on stream "fd'
+ * Must not be called from the reader thread, which it would wait for
  * returns 0 on success, -1 on error
  */
 int at_open(int fd, ATUnsolHandler h)
 {
     int ret;
-    pthread_t tid;
-    pthread_attr_t attr;
 
-    s_fd = fd;
+    /* a reader that called at_close() itself may still be on its way
+       out, and would see the new channel as closed */
+    pthread_mutex_lock(&s_commandmutex);
+    while (s_readerThreadRunning) {
+        pthread_cond_wait(&s_readerExitCond, &s_commandmutex);
+    }
+    pthread_mutex_unlock(&s_commandmutex);
+
+    /* a dispatcher left behind by an at_close() from a handler may still
+       be draining the ring */
+    pthread_mutex_lock(&s_dispatchMutex);
+    while (s_dispatcherRunning) {
+        pthread_cond_wait(&s_dispatcherExitCond, &s_dispatchMutex);
+    }
+    pthread_mutex_unlock(&s_dispatchMutex);
+
     s_unsolHandler = h;
     s_readerClosed = 0;
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+    s_dispatchHead = 0;
+    s_dispatchTail = 0;
+    s_dispatchPending = 0;
+    s_dispatcherStop = 0;
 
     /* Android power control ioctl */
 #ifdef HAVE_ANDROID_OS
@@ -640,166 +2457,322 @@ int at_open(int fd, ATUnsolHandler h)
 #endif // OMAP_CSMI_POWER_CONTROL
 #endif /*HAVE_ANDROID_OS*/
 
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    initChannel(&s_channels[0], fd, AT_CHANNEL_PRIMARY);
+    s_channelCount = 1;
+
+    s_wakefd = eventfd(0, EFD_NONBLOCK);
+    s_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    s_epfd = epoll_create(MAX_EPOLL_EVENTS);
+
+    if (s_wakefd < 0 || s_timerfd < 0 || s_epfd < 0
+        || addEpollFd(fd) < 0 || addEpollFd(s_wakefd) < 0
+        || addEpollFd(s_timerfd) < 0
+    ) {
+        LOGE("atchannel: unable to set up reader %s", strerror(errno));
+        closeReaderFds();
+        return -1;
+    }
+
+    s_dispatchfd = eventfd(0, 0);
+
+    if (s_dispatchfd < 0) {
+        LOGE("atchannel: unable to set up dispatcher %s", strerror(errno));
+        closeReaderFds();
+        return -1;
+    }
+
+    s_dispatcherRunning = 1;
 
-    ret = pthread_create(&s_tid_reader, &attr, readerLoop, &attr);
+    ret = pthread_create(&s_tid_dispatcher, NULL, dispatchLoop, NULL);
 
-    if (ret < 0) {
-        perror ("pthread_create");
+    if (ret != 0) {
+        LOGE("atchannel: pthread_create failed %s", strerror(ret));
+        s_dispatcherRunning = 0;
+        closeReaderFds();
         return -1;
     }
 
+    s_readerRunning = 1;
+    s_readerThreadRunning = 1;
+
+    /* joinable, so that at_close() can wait for it */
+    ret = pthread_create(&s_tid_reader, NULL, readerLoop, NULL);
+
+    if (ret != 0) {
+        LOGE("atchannel: pthread_create failed %s", strerror(ret));
+        s_readerRunning = 0;
+        s_readerThreadRunning = 0;
+        stopDispatcher();
+        closeReaderFds();
+        return -1;
+    }
 
     return 0;
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
-void at_close()
+/**
+ * Adds another fd to the open AT channel, eg a CMUX DLC or a second
+ * port of the same modem; see ATChannelRole for what it is used for.
+ * at_close() closes it along with the primary fd
+ * returns 0 on success, -1 on error
+ */
+int at_add_channel(int fd, ATChannelRole role)
 {
-    if (s_fd >= 0) {
-        close(s_fd);
+    ATChannel *p_channel;
+    int ret = -1;
+
+    if (role == AT_CHANNEL_PRIMARY) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    if (s_readerRunning == 0 || s_readerClosed
+        || s_channelCount == MAX_AT_CHANNELS
+    ) {
+        goto error;
+    }
+
+    p_channel = &s_channels[s_channelCount];
+    initChannel(p_channel, fd, role);
+
+    /* the reader looks channels up without the lock */
+    __sync_synchronize();
+    s_channelCount++;
+
+    if (addEpollFd(fd) < 0) {
+        LOGE("atchannel: unable to add channel %s", strerror(errno));
+        s_channelCount--;
+        goto error;
     }
-    s_fd = -1;
+
+    ret = 0;
+
+error:
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return ret;
+}
+
+/**
+ * Stops the reader thread and closes the AT channel
+ * Safe to call from the reader thread (eg from the reader closed
+ * callback) as well as from a command thread, and more than once
+ */
+void at_close()
+{
+    int running;
+    int i;
+    uint64_t one = 1;
 
     pthread_mutex_lock(&s_commandmutex);
 
+    running = s_readerRunning;
+    s_readerRunning = 0;
     s_readerClosed = 1;
 
-    pthread_cond_signal(&s_commandcond);
+    pthread_cond_broadcast(&s_commandcond);
 
     pthread_mutex_unlock(&s_commandmutex);
 
-    /* the reader thread should eventually die */
+    if (!running) {
+        return;
+    }
+
+    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+        /* readerLoop() returns as soon as we're done here */
+        pthread_detach(s_tid_reader);
+    } else {
+        /* wake the reader out of epoll_wait() and wait for it to exit */
+        if (write(s_wakefd, &one, sizeof(one)) < 0) {
+            LOGE("atchannel: unable to wake reader %s", strerror(errno));
+        }
+        pthread_join(s_tid_reader, NULL);
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+    failAllCommands(AT_ERROR_CHANNEL_CLOSED);
+    pthread_mutex_unlock(&s_commandmutex);
+
+    /* delivers the failed async commands */
+    stopDispatcher();
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    closeReaderFds();
+
+    for (i = 0 ; i < s_channelCount ; i++) {
+        if (s_channels[i].fd >= 0) {
+            close(s_channels[i].fd);
+        }
+        s_channels[i].fd = -1;
+    }
+
+    s_channelCount = 0;
+
+    /* the modem may be reset before the channel is reopened */
+    forgetSharedResults();
+
+    pthread_mutex_unlock(&s_commandmutex);
 }
 
 static ATResponse * at_response_new()
 {
-    return (ATResponse *) calloc(1, sizeof(ATResponse));
+    ATArena *p_arena;
+
+    pthread_mutex_lock(&s_arenaMutex);
+
+    p_arena = s_arenaPool;
+
+    if (p_arena != NULL) {
+        s_arenaPool = p_arena->p_nextFree;
+        s_arenaPoolCount--;
+    }
+
+    pthread_mutex_unlock(&s_arenaMutex);
+
+    if (p_arena == NULL) {
+        p_arena = (ATArena *) malloc(sizeof(ATArena));
+
+        if (p_arena == NULL) {
+            return NULL;
+        }
+    }
+
+    memset(&p_arena->response, 0, sizeof(ATResponse));
+    p_arena->p_nextFree = NULL;
+    p_arena->p_tail = NULL;
+    p_arena->p_chunks = NULL;
+    p_arena->used = 0;
+
+    return &p_arena->response;
 }
 
 void at_response_free(ATResponse *p_response)
 {
-    ATLine *p_line;
+    ATArena *p_arena = (ATArena *) p_response;
+    ATArenaChunk *p_chunk;
 
     if (p_response == NULL) return;
 
-    p_line = p_response->p_intermediates;
+    /* overflow chunks are not pooled; large responses are rare */
+    while (p_arena->p_chunks != NULL) {
+        p_chunk = p_arena->p_chunks;
+        p_arena->p_chunks = p_chunk->p_next;
+        free(p_chunk);
+    }
+
+    pthread_mutex_lock(&s_arenaMutex);
+
+    if (s_arenaPoolCount < ARENA_POOL_SIZE) {
+        p_arena->p_nextFree = s_arenaPool;
+        s_arenaPool = p_arena;
+        s_arenaPoolCount++;
+        p_arena = NULL;
+    }
 
-    while (p_line != NULL) {
-        ATLine *p_toFree;
+    pthread_mutex_unlock(&s_arenaMutex);
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+    free(p_arena);
+}
+
+/**
+ * returns 1 if a command must not share the channel with other
+ * in-flight commands
+ */
+static int isBarrierCommand(const char *responsePrefix, const char *smspdu)
+{
+    /* the "> " prompt belongs to whoever is at the head of the pipeline */
+    if (smspdu != NULL) {
+        return 1;
+    }
 
-        free(p_toFree->line);
-        free(p_toFree);
+    /* completed early by the +CPIN fix; nothing may be in flight
+       behind it when its real final response is swallowed */
+    if (responsePrefix != NULL && 0 == strcmp(responsePrefix, "+CPIN:")) {
+        return 1;
     }
 
-    free (p_response->finalResponse);
-    free (p_response);
+    return 0;
 }
 
 /**
- * The line reader places the intermediate responses in reverse order
- * here we flip them back
+ * submits a command that lives on the caller's stack and waits for its
+ * final response, which is handed to the caller or freed
+ * assumes s_commandmutex is held
  */
-static void reverseIntermediates(ATResponse *p_response)
+static int submitAndWait(ATCommand *p_cmd, ATResponse **pp_outResponse)
 {
-    ATLine *pcur,*pnext;
+    int err;
 
-    pcur = p_response->p_intermediates;
-    p_response->p_intermediates = NULL;
+    submitCommand(p_cmd);
+
+    while (p_cmd->state != CMD_DONE && s_readerClosed == 0) {
+        pthread_cond_wait(&s_commandcond, &s_commandmutex);
+    }
+
+    if (p_cmd->state != CMD_DONE) {
+        unlinkPendingCommand(p_cmd);
+        err = AT_ERROR_CHANNEL_CLOSED;
+    } else {
+        err = p_cmd->err;
+    }
 
-    while (pcur != NULL) {
-        pnext = pcur->p_next;
-        pcur->p_next = p_response->p_intermediates;
-        p_response->p_intermediates = pcur;
-        pcur = pnext;
+    if (err < 0 || pp_outResponse == NULL) {
+        at_response_free(p_cmd->p_response);
+    } else {
+        *pp_outResponse = p_cmd->p_response;
     }
+
+    return err;
 }
 
 /**
  * Internal send_command implementation
  * Doesn't lock or call the timeout callback
  *
- * timeoutMsec == 0 means infinite timeout
+ * Queues the command behind any others waiting for the pipeline and
+ * waits for its final response. Other callers may write their commands
+ * while this one is in flight, up to s_pipelineDepth of them.
+ *
+ * timeoutMsec == 0 means infinite timeout, AT_TIMEOUT_DEFAULT picks one
+ * suited to the command
  */
 
 static int at_send_command_full_nolock (const char *command, ATCommandType type,
                     const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
+                    long long timeoutMsec, int barrier,
+                    ATResponse **pp_outResponse)
 {
-    int err = 0;
-#ifndef USE_NP
-    struct timespec ts;
-#endif /*USE_NP*/
-
-    if(sp_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
-    }
-
-    err = writeline (command);
-
-    if (err < 0) {
-        goto error;
-    }
-
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
-
-#ifndef USE_NP
-    if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
-    }
-#endif /*USE_NP*/
+    ATCommand cmd;
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
-        if (timeoutMsec != 0) {
-#ifdef USE_NP
-            err = pthread_cond_timeout_np(&s_commandcond, &s_commandmutex, timeoutMsec);
-#else
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
-#endif /*USE_NP*/
-        } else {
-            err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
-        }
-
-        if (err == ETIMEDOUT) {
-            err = AT_ERROR_TIMEOUT;
-            goto error;
-        }
+    if (s_readerClosed > 0) {
+        return AT_ERROR_CHANNEL_CLOSED;
     }
 
-    if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
-    } else {
-        /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
-    }
+    memset(&cmd, 0, sizeof(cmd));
 
-    sp_response = NULL;
+    cmd.p_response = at_response_new();
 
-    if(s_readerClosed > 0) {
-        err = AT_ERROR_CHANNEL_CLOSED;
-        goto error;
+    if (cmd.p_response == NULL) {
+        return AT_ERROR_GENERIC;
     }
 
-    err = 0;
-error:
-    clearPendingCommand();
+    cmd.command = command;
+    cmd.type = type;
+    cmd.responsePrefix = responsePrefix;
+    cmd.smsPDU = smspdu;
+    cmd.timeoutMsec = timeoutMsec;
+    cmd.barrier = barrier;
 
-    return err;
+    return submitAndWait(&cmd, pp_outResponse);
 }
 
 /**
  * Internal send_command implementation
  *
- * timeoutMsec == 0 means infinite timeout
+ * timeoutMsec == 0 means infinite timeout, AT_TIMEOUT_DEFAULT picks one
+ * suited to the command
  */
 static int at_send_command_full (const char *command, ATCommandType type,
                     const char *responsePrefix, const char *smspdu,
@@ -812,11 +2785,17 @@ static int at_send_command_full (const char *command, ATCommandType type,
         return AT_ERROR_INVALID_THREAD;
     }
 
+    if (command == NULL) {
+        /* eg an ATCmd that did not fit its buffer */
+        return AT_ERROR_GENERIC;
+    }
+
     pthread_mutex_lock(&s_commandmutex);
 
     err = at_send_command_full_nolock(command, type,
-                    responsePrefix, smspdu,
-                    timeoutMsec, pp_outResponse);
+                    responsePrefix, smspdu, timeoutMsec,
+                    isBarrierCommand(responsePrefix, smspdu),
+                    pp_outResponse);
 
     pthread_mutex_unlock(&s_commandmutex);
 
@@ -842,7 +2821,7 @@ int at_send_command (const char *command, ATResponse **pp_outResponse)
     int err;
 
     err = at_send_command_full (command, NO_RESULT, NULL,
-                                    NULL, 0, pp_outResponse);
+                                    NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
     return err;
 }
@@ -855,7 +2834,7 @@ int at_send_command_singleline (const char *command,
     int err;
 
     err = at_send_command_full (command, SINGLELINE, responsePrefix,
-                                    NULL, 0, pp_outResponse);
+                                    NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
     if (err == 0 && pp_outResponse != NULL
         && (*pp_outResponse)->success > 0
@@ -877,7 +2856,7 @@ int at_send_command_numeric (const char *command,
     int err;
 
     err = at_send_command_full (command, NUMERIC, NULL,
-                                    NULL, 0, pp_outResponse);
+                                    NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
     if (err == 0 && pp_outResponse != NULL
         && (*pp_outResponse)->success > 0
@@ -901,7 +2880,7 @@ int at_send_command_sms (const char *command,
     int err;
 
     err = at_send_command_full (command, SINGLELINE, responsePrefix,
-                                    pdu, 0, pp_outResponse);
+                                    pdu, AT_TIMEOUT_DEFAULT, pp_outResponse);
 
     if (err == 0 && pp_outResponse != NULL
         && (*pp_outResponse)->success > 0
@@ -924,12 +2903,449 @@ int at_send_command_multiline (const char *command,
     int err;
 
     err = at_send_command_full (command, MULTILINE, responsePrefix,
-                                    NULL, 0, pp_outResponse);
+                                    NULL, AT_TIMEOUT_DEFAULT, pp_outResponse);
+
+    return err;
+}
+
+
+/** returns 1 if the command may share a command line with others */
+static int isBatchable(const ATBatchCommand *p_command)
+{
+    return strStartsWith(p_command->command, "AT")
+        && !matchesAny(p_command->command, s_unbatchableCommands,
+                        NUM_ELEMS(s_unbatchableCommands))
+        && !matchesAny(p_command->command, s_abortableCommands,
+                        NUM_ELEMS(s_abortableCommands))
+        && !isBarrierCommand(p_command->responsePrefix, NULL);
+}
+
+/**
+ * Concatenates as many of the commands as can go on one line into
+ * line, per V.250 5.4: basic commands follow each other directly and
+ * an extended command is ended by ';' if another one follows. Commands
+ * that go to different channels are not combined.
+ * returns the number of commands used, at least 1
+ * assumes s_commandmutex is held
+ */
+static int buildBatchLine(const ATBatchCommand *p_commands, int count,
+                            char *line)
+{
+    ATChannel *p_channel;
+    const char *body;
+    size_t len, bodyLen;
+    int extended = 0;
+    int n;
+
+    if (!isBatchable(&p_commands[0])) {
+        return 1;
+    }
+
+    p_channel = routeCommandLine(p_commands[0].command);
+    strcpy(line, "AT");
+    len = 2;
+
+    for (n = 0 ; n < count ; n++) {
+        if (n > 0 && (!isBatchable(&p_commands[n])
+                || routeCommandLine(p_commands[n].command) != p_channel)) {
+            break;
+        }
+
+        body = p_commands[n].command + 2;
+        bodyLen = strlen(body);
+
+        if (len + extended + bodyLen > MAX_BATCH_LINE + 2) {
+            break;
+        }
+
+        if (extended) {
+            line[len++] = ';';
+        }
+
+        memcpy(line + len, body, bodyLen + 1);
+        len += bodyLen;
+
+        extended = !isalpha(body[0]) && body[0] != '&';
+    }
+
+    return n > 0 ? n : 1;
+}
+
+/**
+ * returns the index of the command at or after last, the one that took
+ * the previous intermediate response, that takes line, or -1
+ */
+static int nextBatchCommand(const ATBatchCommand *p_commands, int count,
+                            int last, const char *line)
+{
+    int i;
+
+    for (i = last < 0 ? 0 : last ; i < count ; i++) {
+        if (i == last && p_commands[i].type != MULTILINE) {
+            /* already has its one line */
+            continue;
+        }
+
+        if (batchCommandAccepts(&p_commands[i], NULL, line)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Splits the response to a batch line into one response per command
+ * that is known to have run. Lines are handed out in order: each goes
+ * to the first command at or after the previous line's that takes it.
+ * V.250 stops a rejected line at the failing command, so only
+ * the commands up to the last one with an intermediate response have
+ * run; each of those gets its own OK. pp_outResponses may be NULL
+ * returns the number of commands that ran, AT_ERROR_GENERIC if out of
+ * memory
+ */
+static int splitBatchResponse(const ATResponse *p_response,
+                                const ATBatchCommand *p_commands, int count,
+                                ATResponse **pp_outResponses)
+{
+    ATLine *p_cur;
+    int i, last = -1, ran;
+
+    for (p_cur = p_response->p_intermediates ; p_cur != NULL
+            ; p_cur = p_cur->p_next) {
+        i = nextBatchCommand(p_commands, count, last, p_cur->line);
+
+        if (i >= 0) {
+            last = i;
+        }
+    }
+
+    ran = p_response->success ? count : last + 1;
+
+    if (pp_outResponses == NULL) {
+        return ran;
+    }
+
+    for (i = 0 ; i < ran ; i++) {
+        pp_outResponses[i] = at_response_new();
+
+        if (pp_outResponses[i] == NULL) {
+            while (i-- > 0) {
+                at_response_free(pp_outResponses[i]);
+                pp_outResponses[i] = NULL;
+            }
+            return AT_ERROR_GENERIC;
+        }
+
+        pp_outResponses[i]->success = 1;
+        pp_outResponses[i]->finalResponse = arenaStrdup(pp_outResponses[i],
+                                                        "OK");
+    }
+
+    last = -1;
+
+    for (p_cur = p_response->p_intermediates ; p_cur != NULL
+            ; p_cur = p_cur->p_next) {
+        i = nextBatchCommand(p_commands, ran, last, p_cur->line);
+
+        if (i >= 0) {
+            appendIntermediate(pp_outResponses[i], p_cur->line);
+            last = i;
+        }
+    }
+
+    return ran;
+}
+
+/**
+ * sends count commands one at a time
+ * assumes s_commandmutex is held
+ */
+static int sendSeparately(const ATBatchCommand *p_commands, int count,
+                            ATResponse **pp_outResponses)
+{
+    int i, err = 0;
+
+    for (i = 0 ; i < count && err >= 0 ; i++) {
+        err = at_send_command_full_nolock(p_commands[i].command,
+                        p_commands[i].type, p_commands[i].responsePrefix,
+                        NULL, AT_TIMEOUT_DEFAULT,
+                        isBarrierCommand(p_commands[i].responsePrefix, NULL),
+                        pp_outResponses != NULL ? &pp_outResponses[i] : NULL);
+    }
+
+    return err;
+}
+
+/**
+ * sends count commands as the single command line in line. If the
+ * modem rejects it, the commands from the first one not known to have
+ * run, see splitBatchResponse(), are sent again one at a time to find
+ * out which one failed
+ * assumes s_commandmutex is held
+ */
+static int sendBatchLine(char *line, const ATBatchCommand *p_commands,
+                            int count, ATResponse **pp_outResponses)
+{
+    ATResponse *p_response = NULL;
+    ATCommand cmd;
+    int i, err, ran;
+
+    memset(&cmd, 0, sizeof(cmd));
+
+    cmd.p_response = at_response_new();
+
+    if (cmd.p_response == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    cmd.command = line;
+    cmd.type = MULTILINE;
+    cmd.p_batch = p_commands;
+    cmd.batchCount = count;
+    cmd.timeoutMsec = 0;
+
+    /* the modem runs them one after the other */
+    for (i = 0 ; i < count ; i++) {
+        cmd.timeoutMsec += getDefaultTimeout(p_commands[i].command);
+    }
+
+    err = submitAndWait(&cmd, &p_response);
+
+    if (err < 0) {
+        return err;
+    }
+
+    ran = splitBatchResponse(p_response, p_commands, count,
+                                pp_outResponses);
+
+    at_response_free(p_response);
+
+    if (ran < 0) {
+        return ran;
+    }
+
+    if (ran < count) {
+        return sendSeparately(p_commands + ran, count - ran,
+                    pp_outResponses != NULL ? pp_outResponses + ran : NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Sends several commands with as few command lines, and so round
+ * trips, as possible, see buildBatchLine(). pp_outResponses, if not
+ * NULL, receives one response per command, as if each had been sent
+ * with at_send_command_full(); a command the modem rejected gets an
+ * unsuccessful response like it would on its own. When a line is
+ * rejected, the set commands after the last one that answered may have
+ * run and are sent again, so only batch commands that can be repeated.
+ *
+ * returns 0 once every command has been answered, or the first
+ * AT_ERROR_* met, in which case no responses are returned
+ */
+int at_send_batch(const ATBatchCommand *p_commands, int count,
+                    ATResponse **pp_outResponses)
+{
+    char line[MAX_BATCH_LINE + 3];
+    int i, n, err = 0;
+
+    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    if (pp_outResponses != NULL) {
+        memset(pp_outResponses, 0, count * sizeof(ATResponse *));
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    for (i = 0 ; i < count && err >= 0 ; i += n) {
+        if (s_readerClosed > 0) {
+            err = AT_ERROR_CHANNEL_CLOSED;
+            break;
+        }
+
+        n = buildBatchLine(p_commands + i, count - i, line);
+
+        if (n == 1) {
+            err = sendSeparately(p_commands + i, 1,
+                    pp_outResponses != NULL ? pp_outResponses + i : NULL);
+        } else {
+            err = sendBatchLine(line, p_commands + i, n,
+                    pp_outResponses != NULL ? pp_outResponses + i : NULL);
+        }
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    for (i = 0 ; pp_outResponses != NULL && err >= 0 && i < count ; i++) {
+        if ((p_commands[i].type == SINGLELINE
+                || p_commands[i].type == NUMERIC)
+            && pp_outResponses[i]->success > 0
+            && pp_outResponses[i]->p_intermediates == NULL
+        ) {
+            /* successful command must have an intermediate response */
+            err = AT_ERROR_INVALID_RESPONSE;
+        }
+    }
+
+    if (err < 0 && pp_outResponses != NULL) {
+        for (i = 0 ; i < count ; i++) {
+            at_response_free(pp_outResponses[i]);
+            pp_outResponses[i] = NULL;
+        }
+    }
+
+    if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
+        s_onTimeout();
+    }
 
     return err;
 }
 
 
+/**
+ * Internal async send_command implementation
+ * Copies the strings, so the caller's may go away once this returns
+ */
+static int at_send_command_async_full (const char *command,
+                    ATCommandType type, const char *responsePrefix,
+                    const char *smspdu, long long timeoutMsec,
+                    ATResponseCallback callback, void *param)
+{
+    ATCommand *p_cmd;
+    size_t commandLen;
+    size_t prefixLen = (responsePrefix != NULL) ? strlen(responsePrefix) + 1 : 0;
+    size_t pduLen = (smspdu != NULL) ? strlen(smspdu) + 1 : 0;
+    char *p_strings;
+
+    if (callback == NULL || command == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    commandLen = strlen(command) + 1;
+
+    p_cmd = (ATCommand *) calloc(1, sizeof(ATCommand)
+                                    + commandLen + prefixLen + pduLen);
+
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    p_cmd->p_response = at_response_new();
+
+    if (p_cmd->p_response == NULL) {
+        free(p_cmd);
+        return AT_ERROR_GENERIC;
+    }
+
+    p_strings = (char *) (p_cmd + 1);
+
+    memcpy(p_strings, command, commandLen);
+    p_cmd->command = p_strings;
+    p_strings += commandLen;
+
+    if (responsePrefix != NULL) {
+        memcpy(p_strings, responsePrefix, prefixLen);
+        p_cmd->responsePrefix = p_strings;
+        p_strings += prefixLen;
+    }
+
+    if (smspdu != NULL) {
+        memcpy(p_strings, smspdu, pduLen);
+        p_cmd->smsPDU = p_strings;
+    }
+
+    p_cmd->type = type;
+    p_cmd->timeoutMsec = timeoutMsec;
+    p_cmd->barrier = isBarrierCommand(responsePrefix, smspdu);
+    p_cmd->callback = callback;
+    p_cmd->param = param;
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    if (s_readerClosed > 0) {
+        pthread_mutex_unlock(&s_commandmutex);
+        at_response_free(p_cmd->p_response);
+        free(p_cmd);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    submitCommand(p_cmd);
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return 0;
+}
+
+/**
+ * Issue an AT command without waiting for its final response
+ *
+ * "callback" is called exactly once, on atchannel's dispatch thread,
+ * unless this returns an error. May be called from any thread,
+ * including from unsolicited handlers and other callbacks.
+ *
+ * timeoutMsec == 0 means infinite timeout, AT_TIMEOUT_DEFAULT picks one
+ * suited to the command
+ */
+int at_send_command_async (const char *command, ATCommandType type,
+                            const char *responsePrefix, long long timeoutMsec,
+                            ATResponseCallback callback, void *param)
+{
+    return at_send_command_async_full(command, type, responsePrefix,
+                                        NULL, timeoutMsec, callback, param);
+}
+
+int at_send_command_sms_async (const char *command, const char *pdu,
+                            const char *responsePrefix, long long timeoutMsec,
+                            ATResponseCallback callback, void *param)
+{
+    return at_send_command_async_full(command, SINGLELINE, responsePrefix,
+                                        pdu, timeoutMsec, callback, param);
+}
+
+
+/**
+ * Sets how many commands may be in flight at once. The default of 1
+ * waits for each final response before writing the next command;
+ * only raise it for modems that queue pipelined command lines.
+ */
+void at_set_pipeline_depth(int depth)
+{
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MAX_PIPELINE_DEPTH) {
+        depth = MAX_PIPELINE_DEPTH;
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+
+    s_pipelineDepth = depth;
+
+    /* a deeper pipeline may have room for waiting commands */
+    issueCommands();
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+/**
+ * When enabled, commands sent with AT_TIMEOUT_DEFAULT get a timeout
+ * derived from the response times seen for the same command (a margin
+ * over the 99th percentile, never below MIN_ADAPTIVE_TIMEOUT_MSEC and
+ * never above the static default), so a hung modem is noticed quickly
+ */
+void at_set_adaptive_timeouts(int enable)
+{
+    pthread_mutex_lock(&s_commandmutex);
+
+    s_adaptiveTimeouts = enable;
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
 /** This callback is invoked on the command thread */
 void at_set_on_timeout(void (*onTimeout)(void))
 {
@@ -949,15 +3365,47 @@ void at_set_on_reader_closed(void (*onClose)(void))
 }
 
 
+/**
+ * sends a NO_RESULT command on p_channel, bypassing routing, and waits
+ * for its final response
+ * assumes s_commandmutex is held
+ */
+static int sendOnChannel(ATChannel *p_channel, const char *command,
+                            long long timeoutMsec)
+{
+    ATCommand cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+
+    cmd.p_response = at_response_new();
+
+    if (cmd.p_response == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    cmd.command = command;
+    cmd.type = NO_RESULT;
+    cmd.timeoutMsec = timeoutMsec;
+    cmd.barrier = 1;
+    cmd.p_channel = p_channel;
+
+    return submitAndWait(&cmd, NULL);
+}
+
 /**
  * Periodically issue an AT command and wait for a response.
  * Used to ensure channel has start up and is active
+ *
+ * Every channel is handshaken, so that echo is off on the ports that
+ * only see routed commands too; those also get AT+CMEE=1, which the
+ * RIL only sends on the primary channel. Returns the primary's result
  */
 
 int at_handshake()
 {
-    int i;
+    int i, c;
     int err = 0;
+    int ret = 0;
 
     if (0 != pthread_equal(s_tid_reader, pthread_self())) {
         /* cannot be called from reader thread */
@@ -966,17 +3414,27 @@ int at_handshake()
 
     pthread_mutex_lock(&s_commandmutex);
 
-    for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
-        /* some stacks start with verbose off */
-        err = at_send_command_full_nolock ("ATE0Q0V1", NO_RESULT,
-                    NULL, NULL, HANDSHAKE_TIMEOUT_MSEC, NULL);
+    for (c = 0 ; c < s_channelCount ; c++) {
+        for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
+            /* some stacks start with verbose off */
+            err = sendOnChannel(&s_channels[c], "ATE0Q0V1",
+                        HANDSHAKE_TIMEOUT_MSEC);
 
-        if (err == 0) {
-            break;
+            if (err == 0) {
+                break;
+            }
+        }
+
+        if (c == 0) {
+            ret = err;
+        } else if (err == 0) {
+            sendOnChannel(&s_channels[c], "AT+CMEE=1", AT_TIMEOUT_DEFAULT);
+        } else {
+            LOGE("atchannel: no answer on channel %d", c);
         }
     }
 
-    if (err == 0) {
+    if (ret == 0) {
         /* pause for a bit to let the input buffer drain any unmatched OK's
            (they will appear as extraneous unsolicited responses) */
 
@@ -985,7 +3443,7 @@ int at_handshake()
 
     pthread_mutex_unlock(&s_commandmutex);
 
-    return err;
+    return ret;
 }
 
 /**
@@ -45,6 +45,9 @@ extern void  AT_DUMP(const char* prefix, const char*  buff, int  len);
                                         did not get back an intermediate
                                         response */
 
+/* timeoutMsec for at_send_command_async(): pick one suited to the command */
+#define AT_TIMEOUT_DEFAULT -1
+
 
 typedef enum {
     NO_RESULT,   /* no intermediate response expected */
@@ -70,17 +73,44 @@ typedef struct {
 
 /**
  * a user-provided unsolicited response handler function
- * this will be called from the reader thread, so do not block
+ * this will be called from atchannel's dispatch thread, in the order
+ * the lines arrived. It does not hold up command completion, but
+ * further unsolicited responses queue up while it runs
  * "s" is the line, and "sms_pdu" is either NULL or the PDU response
  * for multi-line TS 27.005 SMS PDU responses (eg +CMT:)
  */
 typedef void (*ATUnsolHandler)(const char *s, const char *sms_pdu);
 
+/** what a channel added with at_add_channel() is used for */
+typedef enum {
+    AT_CHANNEL_PRIMARY,     /* the at_open() channel, carries everything
+                               not routed elsewhere */
+    AT_CHANNEL_LONG,        /* long-running commands, eg network scans */
+    AT_CHANNEL_UNSOLICITED  /* a notification port: only commands that
+                               enable unsolicited responses are written
+                               here, so everything else read from it is
+                               unsolicited */
+} ATChannelRole;
+
+/**
+ * completion callback for at_send_command_async()
+ * this will be called from atchannel's dispatch thread. "err" is 0 or
+ * one of AT_ERROR_*, and p_response is NULL unless err is 0. p_response
+ * is freed when the callback returns
+ */
+typedef void (*ATResponseCallback)(int err, ATResponse *p_response,
+                                    void *param);
+
 int at_open(int fd, ATUnsolHandler h);
 void at_close();
 
-/* This callback is invoked on the command thread.
-   You should reset or handshake here to avoid getting out of sync */
+/* additional fd, eg a CMUX DLC, to be used after at_open() */
+int at_add_channel(int fd, ATChannelRole role);
+
+/* This callback is invoked on the command thread whose command timed
+   out, or on the reader thread when an asynchronous command times out,
+   after which the reader stops. You should reset or handshake here to
+   avoid getting out of sync; at_close() may be called from either */
 void at_set_on_timeout(void (*onTimeout)(void));
 /* This callback is invoked on the reader thread (like ATUnsolHandler)
    when the input stream closes before you call at_close
@@ -90,6 +120,13 @@ void at_set_on_timeout(void (*onTimeout)(void));
    channel is already closed */
 void at_set_on_reader_closed(void (*onClose)(void));
 
+/* Maximum number of commands in flight at once, default 1.
+   Commands are answered in the order they were written */
+void at_set_pipeline_depth(int depth);
+
+/* derive default timeouts from observed response times */
+void at_set_adaptive_timeouts(int enable);
+
 int at_send_command_singleline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
@@ -101,6 +138,20 @@ int at_send_command_multiline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
 
+/** one command of at_send_batch() */
+typedef struct {
+    const char *command;        /* with its "AT", eg "AT+CMEE=1" */
+    ATCommandType type;
+    const char *responsePrefix; /* for SINGLELINE and MULTILINE */
+} ATBatchCommand;
+
+/* sends the commands on as few command lines as the modem allows and
+   returns one response per command in pp_outResponses[count]. The
+   commands must be safe to repeat: after a rejected line some are sent
+   again */
+int at_send_batch (const ATBatchCommand *p_commands, int count,
+                    ATResponse **pp_outResponses);
+
 
 int at_handshake();
 
@@ -110,6 +161,14 @@ int at_send_command_sms (const char *command, const char *pdu,
                             const char *responsePrefix,
                             ATResponse **pp_outResponse);
 
+int at_send_command_async (const char *command, ATCommandType type,
+                            const char *responsePrefix, long long timeoutMsec,
+                            ATResponseCallback callback, void *param);
+
+int at_send_command_sms_async (const char *command, const char *pdu,
+                            const char *responsePrefix, long long timeoutMsec,
+                            ATResponseCallback callback, void *param);
+
 void at_response_free(ATResponse *p_response);
 
 typedef enum {
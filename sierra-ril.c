@@ -21,6 +21,8 @@
 
 #include <telephony/ril.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
@@ -29,9 +31,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 #include <alloca.h>
 #include "atchannel.h"
 #include "at_tok.h"
+#include "at_schema.h"
+#include "at_cmd.h"
+#include "at_cmux.h"
 #include "misc.h"
 #include <getopt.h>
 #include <sys/socket.h>
@@ -121,6 +127,8 @@ static pthread_cond_t s_state_cond = PTHREAD_COND_INITIALIZER;
 static int s_port = -1;
 static const char * s_device_path = NULL;
 static int s_device_socket = 0;
+static int s_cmux = 0;      /* run the AT channel over 27.010 CMUX */
+static const char * s_notify_path = NULL;   /* port for unsolicited */
 
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
@@ -134,8 +142,35 @@ static char *sNITZtime = NULL;
    We are using XCIEV instead and storing
    values for Android to pick up.
  */
-static int at_csq_rssi = 99;
-static int at_csq_ber = 99;
+
+// Smallest change of the 3GPP <rssi> that is reported to Android
+#ifndef SIGNAL_HYSTERESIS
+#define SIGNAL_HYSTERESIS 2
+#endif
+
+// Shortest time in msec between two signal strength reports
+#ifndef SIGNAL_REPORT_INTERVAL
+#define SIGNAL_REPORT_INTERVAL 2000
+#endif
+
+/*
+ * Signal strength as 3GPP <rssi> and <ber>, 99 if not known. Once
+ * +XCIEV has reported, rssi stays current and RIL_REQUEST_SIGNAL_STRENGTH
+ * is answered from here; until then it goes to AT+CSQ. Reports to
+ * Android are held back until the change reaches SIGNAL_HYSTERESIS, and
+ * come at most once per SIGNAL_REPORT_INTERVAL; a report that comes too
+ * early is deferred to the end of the interval and sends the latest
+ * value. Guarded by s_signalMutex.
+ */
+static struct {
+    int reporting;          /* set by the first +XCIEV */
+    int rssi;
+    int ber;
+    int reportedRssi;       /* last rssi Android was told about */
+    long long reportedAt;   /* CLOCK_MONOTONIC msec of that report */
+    int pending;            /* a deferred report is scheduled */
+} s_signal = { 0, 99, 99, 99, 0, 0 };
+static pthread_mutex_t s_signalMutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /**
@@ -148,9 +183,83 @@ static int at_csq_ber = 99;
 static int access_technology = 0;
 
 static const struct timeval TIMEVAL_SIMPOLL = {1, 0};
-static const struct timeval TIMEVAL_CALLSTATEPOLL = {0, 500000};
 static const struct timeval TIMEVAL_0 = {0, 0};
 
+// Room for a CLCC <number>: up to 80 digits, a '+' and the NUL
+#define CLCC_NUMBER_SIZE 82
+
+// Room for a CRSM <response>: 256 bytes as hex and the NUL
+#define CRSM_RESPONSE_SIZE 513
+
+/* +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>[,<number>,<type>] */
+#define CLCC_FIELDS(F) \
+    F(INT,  index,   0,                AT_REQUIRED) \
+    F(BOOL, isMT,    0,                AT_REQUIRED) \
+    F(INT,  state,   0,                AT_REQUIRED) \
+    F(INT,  mode,    0,                AT_REQUIRED) \
+    F(BOOL, isMpty,  0,                AT_REQUIRED) \
+    F(STR,  number,  CLCC_NUMBER_SIZE, AT_OPTIONAL) \
+    F(INT,  toa,     0,                AT_OPTIONAL)
+
+AT_SCHEMA(CLCCLine, CLCC_FIELDS)
+
+/* +CREG: <n>,<stat>[,<lac>,<ci>[,<AcT>]], in answer to AT+CREG? */
+#define CREG_FIELDS(F) \
+    F(INT,  n,       0,                AT_REQUIRED) \
+    F(INT,  stat,    0,                AT_REQUIRED) \
+    F(HEX,  lac,     0,                AT_OPTIONAL) \
+    F(HEX,  cid,     0,                AT_OPTIONAL) \
+    F(INT,  act,     0,                AT_OPTIONAL)
+
+AT_SCHEMA(CREGLine, CREG_FIELDS)
+
+/* +CREG: <stat>[,<lac>,<ci>[,<AcT>]], unsolicited */
+#define CREG_UNSOL_FIELDS(F) \
+    F(INT,  stat,    0,                AT_REQUIRED) \
+    F(HEX,  lac,     0,                AT_OPTIONAL) \
+    F(HEX,  cid,     0,                AT_OPTIONAL) \
+    F(INT,  act,     0,                AT_OPTIONAL)
+
+AT_SCHEMA(CREGUnsolLine, CREG_UNSOL_FIELDS)
+
+/* +CCFC: <status>,<class>[,<number>,<type>[,<subaddr>,<satype>[,<time>]]] */
+#define CCFC_FIELDS(F) \
+    F(INT,  status,  0,                AT_REQUIRED) \
+    F(INT,  class,   0,                AT_REQUIRED) \
+    F(STR,  number,  CLCC_NUMBER_SIZE, AT_OPTIONAL) \
+    F(INT,  toa,     0,                AT_OPTIONAL) \
+    F(SKIP, subaddr, 0,                AT_OPTIONAL) \
+    F(SKIP, satype,  0,                AT_OPTIONAL) \
+    F(INT,  time,    0,                AT_OPTIONAL)
+
+AT_SCHEMA(CCFCLine, CCFC_FIELDS)
+
+/* +CRSM: <sw1>,<sw2>[,<response>] */
+#define CRSM_FIELDS(F) \
+    F(INT,  sw1,     0,                  AT_REQUIRED) \
+    F(INT,  sw2,     0,                  AT_REQUIRED) \
+    F(STR,  data,    CRSM_RESPONSE_SIZE, AT_OPTIONAL)
+
+AT_SCHEMA(CRSMLine, CRSM_FIELDS)
+
+// Room for an operator name: 16 characters, or 16 UCS2 ones as hex, and the NUL
+#define OPERATOR_NAME_SIZE 68
+
+/* +COPS: <mode>[,<format>,<oper>[,<AcT>]] */
+#define COPS_FIELDS(F) \
+    F(INT,  mode,    0,                  AT_REQUIRED) \
+    F(INT,  format,  0,                  AT_OPTIONAL) \
+    F(STR,  oper,    OPERATOR_NAME_SIZE, AT_OPTIONAL) \
+    F(INT,  act,     0,                  AT_OPTIONAL)
+
+AT_SCHEMA(COPSLine, COPS_FIELDS)
+
+/* +XCIEV: <rssi>[,<battery>]; <rssi> is empty for a battery event */
+#define XCIEV_FIELDS(F) \
+    F(INT,  rssi,    0,                  AT_REQUIRED)
+
+AT_SCHEMA(XCIEVLine, XCIEV_FIELDS)
+
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
 // Max number of times we'll try to repoll when we think
 // we have a AT+CLCC race condition
@@ -164,8 +273,83 @@ static int s_repollCallsCount = 0;
 static int s_expectAnswer = 0;
 #endif /* WORKAROUND_ERRONEOUS_ANSWER */
 
+// Room for an identity string: IMEI(SV), IMSI or model name
+#define IDENTITY_SIZE 64
+
+/*
+ * Modem and SIM identity. None of it changes while the modem stays up
+ * and the same SIM stays in, so the modem identity is read once after
+ * the handshake, the IMSI on the first request after SIM ready, and the
+ * requests answer from here. An empty string means not known yet.
+ * Guarded by s_identityMutex.
+ */
+static struct {
+    char model[IDENTITY_SIZE];      /* AT+CGMM, reported as baseband */
+    char imei[IDENTITY_SIZE];       /* AT+CGSN */
+    char imsi[IDENTITY_SIZE];       /* AT+CIMI */
+} s_identity;
+static pthread_mutex_t s_identityMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Circuit and packet switched registration, kept current from the
+ * +CREG: and +CGREG: unsolicited lines so the registration requests can
+ * answer without a round trip. lac, cid and act are -1 when the network
+ * did not report them. A store that is not valid is filled by the next
+ * request. Guarded by s_registrationMutex.
+ */
+typedef struct {
+    int valid;
+    int stat;
+    int lac;
+    int cid;
+    int act;    /* <AcT>, see enum CREG_AcT */
+} RegistrationState;
+
+static RegistrationState s_csRegistration;  /* +CREG: */
+static RegistrationState s_psRegistration;  /* +CGREG: */
+
+/*
+ * Operator names in long, short and numeric format, as last read from
+ * +COPS?; an empty name was not reported. They only change along with
+ * the registration, so any registration change drops them and bumps
+ * generation, which keeps a query that raced the change from storing
+ * stale names. Guarded by s_registrationMutex.
+ */
+static struct {
+    int valid;
+    unsigned int generation;
+    char names[3][OPERATOR_NAME_SIZE];
+} s_operator;
+
+static pthread_mutex_t s_registrationMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Fallback AT+CLCC poll interval in msec while a call is being set up
+#define CALL_POLL_MIN 500
+#define CALL_POLL_MAX 4000
+
+// FNV-1a hash of an empty call list
+#define CALL_LIST_HASH_EMPTY 2166136261u
+
+/*
+ * Call list tracking. A call progress indication (RING, +CRING, +CCWA,
+ * NO CARRIER, +XCALLSTAT) reads AT+CLCC on the main thread, and
+ * RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED only goes out when the hash of
+ * the list differs from the last list read. While a call is neither
+ * active nor held the read is repeated, backing off from CALL_POLL_MIN
+ * to CALL_POLL_MAX while nothing changes. A poll carries the generation
+ * it was scheduled with and is dropped if another was scheduled since.
+ * Guarded by s_callMutex.
+ */
+static struct {
+    unsigned int hash;          /* of the last call list read */
+    unsigned int generation;    /* of the one poll allowed to run */
+    int interval;               /* msec until the next fallback poll */
+} s_calls = { CALL_LIST_HASH_EMPTY, 0, CALL_POLL_MIN };
+static pthread_mutex_t s_callMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void pollSIMState(void *param);
 static void setRadioState(RIL_RadioState newState);
+static void forgetOperator();
 
 static void HexStr_to_DecInt(char *strings, unsigned int *ints) {
     int i = 0;
@@ -264,56 +448,34 @@ static int idccRSSITo3gpp(int idcc_rssi) {
 }
 
 /**
- * Note: directly modified line and has *p_call point directly into
- * modified line
+ * Note: leaves line untouched; p_call->number points at clcc->number
  */
-static int callFromCLCCLine(char *line, RIL_Call *p_call) {
+static int callFromCLCCLine(const char *line, RIL_Call *p_call,
+        CLCCLine *clcc) {
     //+CLCC: 1,0,2,0,0,\"+18005551212\",145
     //     index,isMT,state,mode,isMpty(,number,TOA)?
 
     int err;
-    int state;
-    int mode;
 
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
-
-    err = at_tok_nextint(&line, &(p_call->index));
-    if (err < 0) goto error;
-
-    err = at_tok_nextbool(&line, &(p_call->isMT));
-    if (err < 0) goto error;
-
-    err = at_tok_nextint(&line, &state);
-    if (err < 0) goto error;
-
-    err = clccStateToRILState(state, &(p_call->state));
+    err = parseCLCCLine(line, clcc);
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &mode);
-    if (err < 0) goto error;
-
-    p_call->isVoice = (mode == 0);
-
-    err = at_tok_nextbool(&line, &(p_call->isMpty));
+    err = clccStateToRILState(clcc->state, &(p_call->state));
     if (err < 0) goto error;
 
-    if (at_tok_hasmore(&line)) {
-        err = at_tok_nextstr(&line, &(p_call->number));
-
-        /* tolerate null here */
-        if (err < 0) return 0;
-
-        // Some lame implementations return strings
-        // like "NOT AVAILABLE" in the CLCC line
-        if (p_call->number != NULL
-                && 0 == strspn(p_call->number, "+0123456789")
-                ) {
-            p_call->number = NULL;
-        }
-
-        err = at_tok_nextint(&line, &p_call->toa);
-        if (err < 0) goto error;
+    p_call->index = clcc->index;
+    p_call->isMT = clcc->isMT;
+    p_call->isVoice = (clcc->mode == 0);
+    p_call->isMpty = clcc->isMpty;
+    p_call->toa = clcc->toa;
+
+    // Some lame implementations return strings
+    // like "NOT AVAILABLE" in the CLCC line; a number
+    // too long for clcc->number is left empty
+    if (clcc->count > 5
+            && 0 != strspn(clcc->number, "+0123456789")
+            ) {
+        p_call->number = clcc->number;
     }
 
     return 0;
@@ -340,34 +502,36 @@ static void onRadioPowerOn() {
 }
 
 /** do post- SIM ready initialization */
-static void onSIMReady() {
-
+static const ATBatchCommand s_simReadyCommands[] = {
     /* Network registration */
-    //at_send_command("AT+COPS=0", NULL);
+    //{ "AT+COPS=0", NO_RESULT, NULL },
 
     /*  Call Waiting notifications */
-    //at_send_command("AT+CCWA=1", NULL);
+    //{ "AT+CCWA=1", NO_RESULT, NULL },
+
+    /*  Call progress notifications */
+    { "AT+XCALLSTAT=1", NO_RESULT, NULL },
 
     /*  No connected line identification */
-    //at_send_command("AT+COLP=0", NULL);
+    //{ "AT+COLP=0", NO_RESULT, NULL },
 
     /*  USSD unsolicited */
-    //at_send_command("AT+CUSD=1", NULL);
+    //{ "AT+CUSD=1", NO_RESULT, NULL },
 
     /*  Enable +CGEV GPRS event notifications, but don't buffer */
-    at_send_command("AT+CGEREP=2", NULL);
+    { "AT+CGEREP=2", NO_RESULT, NULL },
 
     /*  SMS PDU mode */
-    //at_send_command("AT+CMGF=0", NULL);
+    //{ "AT+CMGF=0", NO_RESULT, NULL },
 
     /* Enable NITZ reporting */
-    //at_send_command("AT+CTZU=1", NULL);
-    //at_send_command("AT+CTZR=1", NULL);
+    //{ "AT+CTZU=1", NO_RESULT, NULL },
+    //{ "AT+CTZR=1", NO_RESULT, NULL },
 
     /* Enable unsolizited RSSI reporting */
-    //at_send_command("AT+XMER=1", NULL);
+    { "AT+XMER=1", NO_RESULT, NULL },
 
-    at_send_command_singleline("AT+CSMS=1", "+CSMS:", NULL);
+    { "AT+CSMS=1", SINGLELINE, "+CSMS:" },
     /*
      * Always send SMS messages directly to the TE
      *
@@ -378,7 +542,20 @@ static void onSIMReady() {
      * ds = 1   // Status reports routed to TE
      * bfr = 1  // flush buffer
      */
-    at_send_command("AT+CNMI=1,2,2,1,1", NULL);
+    { "AT+CNMI=1,2,2,1,1", NO_RESULT, NULL },
+};
+
+static void forgetIdentity(int modem);
+
+static void onSIMReady() {
+    /* one round trip unless the notifications go to another port */
+    at_send_batch(s_simReadyCommands,
+            sizeof(s_simReadyCommands) / sizeof(s_simReadyCommands[0]), NULL);
+
+    /* the SIM may have been swapped while it was not ready; the IMSI is
+       read on the first RIL_REQUEST_GET_IMSI, as AT+CIMI can keep
+       failing for a few seconds after the SIM turns ready */
+    forgetIdentity(0);
 }
 
 static void requestRadioPower(void *data, size_t datalen, RIL_Token t) {
@@ -432,9 +609,11 @@ static void requestDataCallList(void *data, size_t datalen, RIL_Token t) {
 static void requestOrSendDataCallList(RIL_Token *t) {
     ATResponse *p_response;
     ATLine *p_cur;
+    ATTokIndex fields;
     int err;
     int n = 0;
-    char *out;
+    const char *out;
+    int length;
 
     err = at_send_command_multiline("AT+CGACT?", "+CGACT:", &p_response);
     if (err != 0 || p_response->success == 0) {
@@ -465,17 +644,15 @@ static void requestOrSendDataCallList(RIL_Token *t) {
     RIL_Data_Call_Response *response = responses;
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
             p_cur = p_cur->p_next) {
-        char *line = p_cur->line;
-
-        err = at_tok_start(&line);
+        err = at_tok_index(p_cur->line, &fields);
         if (err < 0)
             goto error;
 
-        err = at_tok_nextint(&line, &response->cid);
+        err = at_tok_fieldint(&fields, 0, &response->cid);
         if (err < 0)
             goto error;
 
-        err = at_tok_nextint(&line, &response->active);
+        err = at_tok_fieldint(&fields, 1, &response->active);
         if (err < 0)
             goto error;
 
@@ -496,18 +673,13 @@ static void requestOrSendDataCallList(RIL_Token *t) {
 
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
             p_cur = p_cur->p_next) {
-        char *line = p_cur->line;
         int cid;
-        char *type;
-        char *apn;
-        char *address;
-
 
-        err = at_tok_start(&line);
+        err = at_tok_index(p_cur->line, &fields);
         if (err < 0)
             goto error;
 
-        err = at_tok_nextint(&line, &cid);
+        err = at_tok_fieldint(&fields, 0, &cid);
         if (err < 0)
             goto error;
 
@@ -521,26 +693,21 @@ static void requestOrSendDataCallList(RIL_Token *t) {
             continue;
         }
 
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
-
-        responses[i].type = alloca(strlen(out) + 1);
-        strcpy(responses[i].type, out);
-
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
+        /* +CGDCONT: <cid>,<type>,<apn>,<address> */
+        if (at_tok_fieldcount(&fields) < 4)
             goto error;
 
-        responses[i].apn = alloca(strlen(out) + 1);
-        strcpy(responses[i].apn, out);
+        at_tok_fieldstr(&fields, 1, &out, &length);
+        responses[i].type = alloca(length + 1);
+        at_tok_fieldcopy(&fields, 1, responses[i].type, length + 1);
 
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
+        at_tok_fieldstr(&fields, 2, &out, &length);
+        responses[i].apn = alloca(length + 1);
+        at_tok_fieldcopy(&fields, 2, responses[i].apn, length + 1);
 
-        responses[i].address = alloca(strlen(out) + 1);
-        strcpy(responses[i].address, out);
+        at_tok_fieldstr(&fields, 3, &out, &length);
+        responses[i].address = alloca(length + 1);
+        at_tok_fieldcopy(&fields, 3, responses[i].address, length + 1);
     }
 
     at_response_free(p_response);
@@ -565,30 +732,131 @@ error:
     at_response_free(p_response);
 }
 
-static void requestBasebandVersion(void *data, size_t datalen, RIL_Token t) {
+/**
+ * copies a cached identity string into buf, which holds IDENTITY_SIZE
+ * returns 0 if it is known, -1 if not
+ */
+static int getIdentity(const char *field, char *buf) {
+    pthread_mutex_lock(&s_identityMutex);
+    memcpy(buf, field, IDENTITY_SIZE);
+    pthread_mutex_unlock(&s_identityMutex);
+
+    return buf[0] != '\0' ? 0 : -1;
+}
+
+static void setIdentity(char *field, const char *value) {
+    pthread_mutex_lock(&s_identityMutex);
+    strncpy(field, value, IDENTITY_SIZE - 1);
+    field[IDENTITY_SIZE - 1] = '\0';
+    pthread_mutex_unlock(&s_identityMutex);
+}
+
+/** forgets the SIM identity, or with modem set everything */
+static void forgetIdentity(int modem) {
+    pthread_mutex_lock(&s_identityMutex);
+
+    s_identity.imsi[0] = '\0';
+
+    if (modem) {
+        s_identity.model[0] = '\0';
+        s_identity.imei[0] = '\0';
+    }
+
+    pthread_mutex_unlock(&s_identityMutex);
+}
+
+/** reads AT+CGMM into the cache and model; returns 0 on success */
+static int queryModel(char *model) {
     int err;
     ATResponse *p_response = NULL;
-    char * response = NULL;
-    char* line = NULL;
+    char *response = NULL;
+    char *line;
 
     err = at_send_command_singleline("AT+CGMM", "", &p_response);
     if (err != 0) goto error;
 
     line = p_response->p_intermediates->line;
 
-    response = (char *) alloca(sizeof (char *));
-
     err = at_tok_nextstr(&line, &response);
-    if (err < 0) goto error;
+    if (err < 0 || response == NULL) goto error;
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof (char *));
+    setIdentity(s_identity.model, response);
     at_response_free(p_response);
-    return;
+
+    return getIdentity(s_identity.model, model);
 
 error:
     at_response_free(p_response);
-    LOGE("ERROR: requestBasebandVersion failed\n");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    return -1;
+}
+
+/** reads AT+CGSN into the cache and imei; returns 0 on success */
+static int queryIMEI(char *imei) {
+    int err;
+    ATResponse *p_response = NULL;
+
+    err = at_send_command_numeric("AT+CGSN", &p_response);
+
+    if (err < 0 || p_response->success == 0) {
+        at_response_free(p_response);
+        return -1;
+    }
+
+    setIdentity(s_identity.imei, p_response->p_intermediates->line);
+    at_response_free(p_response);
+
+    return getIdentity(s_identity.imei, imei);
+}
+
+/** reads AT+CIMI into the cache and imsi; returns 0 on success */
+static int queryIMSI(char *imsi) {
+    ATResponse *p_response = NULL;
+    int err;
+
+    int loop = 0;
+    int success = 0;
+    /* We are looping here because the command fails on the first try.
+        What needs to be done, is to trap the "+CME ERROR: 14" which means
+        SIM BUSY and retry that. As a workaround for now, simply try, wait
+        1 second, and try again, until a valid result is obtained. Usually only
+        takes 2 tries.
+     */
+    while (loop < 10) {
+        at_response_free(p_response);
+        p_response = NULL;
+
+        err = at_send_command_numeric("AT+CIMI", &p_response);
+        if (err < 0 || p_response->success == 0) {
+            sleep(1);
+            loop++;
+        } else {
+            loop = 10;
+            success = 1;
+        }
+    }
+
+    if (success == 0) {
+        at_response_free(p_response);
+        return -1;
+    }
+
+    setIdentity(s_identity.imsi, p_response->p_intermediates->line);
+    at_response_free(p_response);
+
+    return getIdentity(s_identity.imsi, imsi);
+}
+
+static void requestBasebandVersion(void *data, size_t datalen, RIL_Token t) {
+    char model[IDENTITY_SIZE];
+
+    if (getIdentity(s_identity.model, model) < 0
+            && queryModel(model) < 0) {
+        LOGE("ERROR: requestBasebandVersion failed\n");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, model, sizeof (char *));
 }
 
 static void requestQueryNetworkSelectionMode(
@@ -927,6 +1195,8 @@ static void requestSetPreferredNetworkType(void *data, size_t datalen, RIL_Token
     err = at_send_command("AT+COPS=0", NULL);
     if (err < 0) goto error;
 
+    forgetOperator();
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, sizeof (int));
     at_response_free(p_response);
     return;
@@ -940,7 +1210,8 @@ error:
 static void requestQueryFacilityLock(void *data, size_t datalen, RIL_Token t) {
     int err, rat, response;
     ATResponse *p_response = NULL;
-    char * cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     char * line = NULL;
     char * facility_string = NULL;
     char * facility_password = NULL;
@@ -954,9 +1225,13 @@ static void requestQueryFacilityLock(void *data, size_t datalen, RIL_Token t) {
     facility_class = ((char **) data)[2];
 
 
-    asprintf(&cmd, "AT+CLCK=\"%s\",2,\"%s\",%s", facility_string, facility_password, facility_class);
-    err = at_send_command_singleline(cmd, "+CLCK:", &p_response);
-    free(cmd);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CLCK=");
+    at_cmd_quoted(&cmd, facility_string);
+    at_cmd_int(&cmd, 2);
+    at_cmd_quoted(&cmd, facility_password);
+    at_cmd_param(&cmd, facility_class);
+
+    err = at_send_command_singleline(at_cmd_end(&cmd), "+CLCK:", &p_response);
     if (err < 0 || p_response->success == 0) {
         goto error;
     }
@@ -991,6 +1266,158 @@ static void sendCallStateChanged(void *param) {
             NULL, 0);
 }
 
+/** folds one call into the FNV-1a hash of a call list */
+static unsigned int hashCall(unsigned int hash, const RIL_Call *p_call) {
+    const int fields[] = {
+        p_call->index, p_call->state, p_call->isMT, p_call->isMpty,
+        p_call->isVoice, p_call->toa
+    };
+    const unsigned char *p;
+    size_t i;
+
+    for (p = (const unsigned char *) fields, i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    for (p = (const unsigned char *) p_call->number; p != NULL && *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+
+    // keeps "1" + "23" apart from "12" + "3"
+    return (hash ^ 0xff) * 16777619u;
+}
+
+static int callSettling(const RIL_Call *p_call) {
+    return p_call->state != RIL_CALL_ACTIVE
+            && p_call->state != RIL_CALL_HOLDING;
+}
+
+static void pollCallState(void *param);
+
+/** runs pollCallState in msec; any poll scheduled before is dropped */
+static void scheduleCallPoll(int msec) {
+    unsigned int generation;
+    struct timeval delay;
+
+    pthread_mutex_lock(&s_callMutex);
+    generation = ++s_calls.generation;
+    pthread_mutex_unlock(&s_callMutex);
+
+    delay.tv_sec = msec / 1000;
+    delay.tv_usec = (msec % 1000) * 1000;
+
+    RIL_requestTimedCallback(pollCallState,
+            (void *) (intptr_t) generation, &delay);
+}
+
+/**
+ * Records the hash of a call list just read and, while a call is still
+ * settling, schedules the next fallback poll
+ * returns 1 if the list differs from the one seen before
+ */
+static int updateCallState(unsigned int hash, int settling) {
+    int changed;
+    int interval;
+
+    pthread_mutex_lock(&s_callMutex);
+
+    changed = hash != s_calls.hash;
+    s_calls.hash = hash;
+
+    if (changed) {
+        s_calls.interval = CALL_POLL_MIN;
+    } else if (s_calls.interval < CALL_POLL_MAX) {
+        s_calls.interval = s_calls.interval * 2 < CALL_POLL_MAX
+                ? s_calls.interval * 2 : CALL_POLL_MAX;
+    }
+
+    interval = s_calls.interval;
+
+    pthread_mutex_unlock(&s_callMutex);
+
+    if (settling) {
+        scheduleCallPoll(interval);
+    }
+
+    return changed;
+}
+
+/** timed callback; reads AT+CLCC and reports the list if it changed */
+static void pollCallState(void *param) {
+    int err;
+    int stale;
+    int settling = 0;
+    unsigned int hash = CALL_LIST_HASH_EMPTY;
+    ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    RIL_Call call;
+    CLCCLine clcc;
+
+    pthread_mutex_lock(&s_callMutex);
+    stale = (unsigned int) (intptr_t) param != s_calls.generation;
+    pthread_mutex_unlock(&s_callMutex);
+
+    if (stale || currentState() != RADIO_STATE_SIM_READY) {
+        return;
+    }
+
+    err = at_send_command_multiline("AT+CLCC", "+CLCC:", &p_response);
+
+    if (err != 0 || p_response->success == 0) {
+        /* let the framework ask for itself */
+        at_response_free(p_response);
+        sendCallStateChanged(NULL);
+        return;
+    }
+
+    for (p_cur = p_response->p_intermediates
+            ; p_cur != NULL
+            ; p_cur = p_cur->p_next
+            ) {
+        memset(&call, 0, sizeof(call));
+
+        if (callFromCLCCLine(p_cur->line, &call, &clcc) != 0) {
+            continue;
+        }
+
+        hash = hashCall(hash, &call);
+        settling |= callSettling(&call);
+    }
+
+    at_response_free(p_response);
+
+#ifdef POLL_CALL_STATE
+    // We don't seem to get a "NO CARRIER" message from
+    // smd, so we're forced to poll until the call ends.
+    settling = hash != CALL_LIST_HASH_EMPTY;
+#endif
+
+    if (updateCallState(hash, settling)) {
+        sendCallStateChanged(NULL);
+    }
+}
+
+/**
+ * Called on a call progress indication; reads the call list at once
+ * Called on atchannel's unsolicited dispatch thread
+ */
+static void onCallProgress() {
+    pthread_mutex_lock(&s_callMutex);
+    s_calls.interval = CALL_POLL_MIN;
+    pthread_mutex_unlock(&s_callMutex);
+
+    scheduleCallPoll(0);
+}
+
+/** drops the call list and any poll, for when the radio goes away */
+static void forgetCallState() {
+    pthread_mutex_lock(&s_callMutex);
+    s_calls.hash = CALL_LIST_HASH_EMPTY;
+    s_calls.generation++;
+    s_calls.interval = CALL_POLL_MIN;
+    pthread_mutex_unlock(&s_callMutex);
+}
+
 static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
     int err;
     ATResponse *p_response;
@@ -999,8 +1426,10 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
     int countValidCalls;
     RIL_Call *p_calls;
     RIL_Call **pp_calls;
+    CLCCLine *p_lines;
     int i;
     int needRepoll = 0;
+    unsigned int hash = CALL_LIST_HASH_EMPTY;
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
     int prevIncomingOrWaitingLine;
@@ -1034,6 +1463,7 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
     pp_calls = (RIL_Call **) alloca(countCalls * sizeof (RIL_Call *));
     p_calls = (RIL_Call *) alloca(countCalls * sizeof (RIL_Call));
     memset(p_calls, 0, countCalls * sizeof (RIL_Call));
+    p_lines = alloca(countCalls * sizeof (CLCCLine));
 
     /* init the pointer array */
     for (i = 0; i < countCalls; i++) {
@@ -1044,7 +1474,8 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
             ; p_cur != NULL
             ; p_cur = p_cur->p_next
             ) {
-        err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls);
+        err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls,
+                p_lines + countValidCalls);
 
         if (err != 0) {
             continue;
@@ -1058,11 +1489,8 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
         }
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-        if (p_calls[countValidCalls].state != RIL_CALL_ACTIVE
-                && p_calls[countValidCalls].state != RIL_CALL_HOLDING
-                ) {
-            needRepoll = 1;
-        }
+        hash = hashCall(hash, p_calls + countValidCalls);
+        needRepoll |= callSettling(p_calls + countValidCalls);
 
         countValidCalls++;
     }
@@ -1104,13 +1532,13 @@ static void requestGetCurrentCalls(void *data, size_t datalen, RIL_Token t) {
     at_response_free(p_response);
 
 #ifdef POLL_CALL_STATE
-    if (countValidCalls) { // We don't seem to get a "NO CARRIER" message from
-        // smd, so we're forced to poll until the call ends.
-#else
-    if (needRepoll) {
+    // We don't seem to get a "NO CARRIER" message from
+    // smd, so we're forced to poll until the call ends.
+    needRepoll = countValidCalls > 0;
 #endif
-        RIL_requestTimedCallback(sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
-    }
+
+    /* the framework has this list now; only report what comes after */
+    updateCallState(hash, needRepoll);
     return;
 
 error:
@@ -1120,7 +1548,8 @@ error:
 
 static void requestDial(void *data, size_t datalen, RIL_Token t) {
     RIL_Dial *p_dial;
-    char *cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     const char *clir;
     int ret;
 
@@ -1136,11 +1565,12 @@ static void requestDial(void *data, size_t datalen, RIL_Token t) {
             break; /*subscription default*/
     }
 
-    asprintf(&cmd, "ATD%s%s;", p_dial->address, clir);
+    at_cmd_start(&cmd, buf, sizeof(buf), "ATD");
+    at_cmd_append(&cmd, p_dial->address);
+    at_cmd_append(&cmd, clir);
+    at_cmd_append(&cmd, ";");
 
-    ret = at_send_command(cmd, NULL);
-
-    free(cmd);
+    ret = at_send_command(at_cmd_end(&cmd), NULL);
 
     /* success or failure is ignored by the upper layer here.
        it will call GET_CURRENT_CALLS and determine success that way */
@@ -1149,7 +1579,8 @@ static void requestDial(void *data, size_t datalen, RIL_Token t) {
 
 static void requestWriteSmsToSim(void *data, size_t datalen, RIL_Token t) {
     RIL_SMS_WriteArgs *p_args;
-    char *cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     int length;
     int err;
     ATResponse *p_response = NULL;
@@ -1157,9 +1588,12 @@ static void requestWriteSmsToSim(void *data, size_t datalen, RIL_Token t) {
     p_args = (RIL_SMS_WriteArgs *) data;
 
     length = strlen(p_args->pdu) / 2;
-    asprintf(&cmd, "AT+CMGW=%d,%d", length, p_args->status);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CMGW=");
+    at_cmd_int(&cmd, length);
+    at_cmd_int(&cmd, p_args->status);
 
-    err = at_send_command_sms(cmd, p_args->pdu, "+CMGW:", &p_response);
+    err = at_send_command_sms(at_cmd_end(&cmd), p_args->pdu, "+CMGW:",
+            &p_response);
 
     if (err != 0 || p_response->success == 0) goto error;
 
@@ -1176,17 +1610,17 @@ static void requestHangup(void *data, size_t datalen, RIL_Token t) {
     int *p_line;
 
     int ret;
-    char *cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
 
     p_line = (int *) data;
 
     // 3GPP 22.030 6.5.5
     // "Releases a specific active call X"
-    asprintf(&cmd, "AT+CHLD=1%d", p_line[0]);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CHLD=1");
+    at_cmd_int(&cmd, p_line[0]);
 
-    ret = at_send_command(cmd, NULL);
-
-    free(cmd);
+    ret = at_send_command(at_cmd_end(&cmd), NULL);
 
     /* success or failure is ignored by the upper layer here.
        it will call GET_CURRENT_CALLS and determine success that way */
@@ -1196,16 +1630,25 @@ static void requestHangup(void *data, size_t datalen, RIL_Token t) {
 static void requestSignalStrength(void *data, size_t datalen, RIL_Token t) {
     ATResponse *p_response = NULL;
     int err;
+    int reporting;
     int response[2];
     char *line;
 
-    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+    pthread_mutex_lock(&s_signalMutex);
+    reporting = s_signal.reporting;
+    response[0] = s_signal.rssi;
+    response[1] = s_signal.ber;
+    pthread_mutex_unlock(&s_signalMutex);
 
-    if (err < 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        goto error;
+    if (reporting) {
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof (response));
+        return;
     }
 
+    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+
+    if (err < 0 || p_response->success == 0) goto error;
+
     line = p_response->p_intermediates->line;
 
     err = at_tok_start(&line);
@@ -1217,6 +1660,17 @@ static void requestSignalStrength(void *data, size_t datalen, RIL_Token t) {
     err = at_tok_nextint(&line, &(response[1]));
     if (err < 0) goto error;
 
+    pthread_mutex_lock(&s_signalMutex);
+
+    s_signal.ber = response[1];
+
+    if (!s_signal.reporting) {
+        s_signal.rssi = response[0];
+        s_signal.reportedRssi = response[0];
+    }
+
+    pthread_mutex_unlock(&s_signalMutex);
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof (response));
 
     at_response_free(p_response);
@@ -1230,17 +1684,19 @@ error:
 
 static void requestDtmfStart(void *data, size_t datalen, RIL_Token t) {
     int err;
-    char *cmd;
-    char c;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
+    char c[2];
 
     assert(datalen >= sizeof (char *));
 
-    c = ((char *) data)[0];
+    c[0] = ((char *) data)[0];
+    c[1] = '\0';
 
-    asprintf(&cmd, "AT+VTS=%c", (int) c);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+VTS=");
+    at_cmd_append(&cmd, c);
 
-    err = at_send_command(cmd, NULL);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
     if (err != 0) goto error;
 
@@ -1271,14 +1727,15 @@ error:
 
 static void requestSetMute(void *data, size_t datalen, RIL_Token t) {
     int err;
-    char *cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
 
     assert(datalen >= sizeof (int *));
 
-    asprintf(&cmd, "AT+CMUT=%d", ((int*) data)[0]);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CMUT=");
+    at_cmd_int(&cmd, ((int*) data)[0]);
 
-    err = at_send_command(cmd, NULL);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
     if (err != 0) goto error;
 
@@ -1352,441 +1809,316 @@ static void requestScreenState(void *data, size_t datalen, RIL_Token t) {
     //RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
-static void requestRegistrationState(void *data,
-        size_t datalen, RIL_Token t) {
-
-    int debug_state = 0;
-    int err;
-    int response[4];
-    char * responseStr[4];
-    ATResponse *p_response = NULL;
-    const char *cmd = "AT+CREG?";
-    const char *prefix = "+CREG:";
-    char *line, *p;
+/**
+ * Reads a +CREG: or +CGREG: line into *p_state; lac, cid and act are -1
+ * when not reported. solicited is set for the answer to AT+CREG? or
+ * AT+CGREG? and clear for an unsolicited report.
+ * returns 0 on success and -1 on fail
+ */
+static int parseRegistrationState(const char *line, int solicited,
+        RegistrationState *p_state) {
+    CREGLine creg;
+    CREGUnsolLine unsol;
     int commas;
-    int skip, tmp;
-    int count = 3;
-
-    err = at_send_command_singleline(cmd, prefix, &p_response);
-
-    if (err != 0) goto error;
-
-    line = p_response->p_intermediates->line;
-
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
 
     /* Ok you have to be careful here
      * The solicited version of the CREG response is
-     * +CREG: n, stat, [lac, cid]
+     * +CREG: n, stat, [lac, cid [, AcT]]
      * and the unsolicited version is
-     * +CREG: stat, [lac, cid]
+     * +CREG: stat, [lac, cid [, AcT]]
      * The <n> parameter is basically "is unsolicited creg on?"
      * which it should always be
      *
-     * Now we should normally get the solicited version here,
-     * but the unsolicited version could have snuck in
-     * so we have to handle both
-     *
-     * Also since the LAC and CID are only reported when registered,
-     * we can have 1, 2, 3, or 4 arguments here
-     *
-     * finally, a +CGREG: answer may have a fifth value that corresponds
-     * to the network type, as in;
-     *
-     *   +CGREG: n, stat [,lac, cid [,networkType]]
+     * Now we should normally get the solicited version in answer to
+     * the query, but the unsolicited version could have snuck in
+     * so we have to handle both. The LAC and CID are only reported
+     * when registered, so a short line is told apart by its commas.
+     * Unsolicited lines never carry <n> and need no guessing.
      */
+    if (solicited) {
+        if (at_tok_charcounter((char *) line, ',', &commas) < 0) return -1;
 
-    /* count number of commas */
-    commas = 0;
-    for (p = line; *p != '\0'; p++) {
-        if (*p == ',') commas++;
+        if (commas == 0 || commas == 2) solicited = 0;
     }
 
-    //we are handling here the +CREG responses
-    if (debug_state) LOGI("REQUEST REGISTRATION STATE DEBUG");
-    switch (commas) {
-        case 0: /* +CREG: <stat> */
-            if (debug_state) LOGI("REQUEST CREG,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x NEXTINT END %d", response[0]);
-            response[1] = -1;
-            response[2] = -1;
-            break;
+    if (solicited) {
+        if (parseCREGLine(line, &creg) < 0) return -1;
+    } else {
+        if (parseCREGUnsolLine(line, &unsol) < 0) return -1;
 
-        case 1: /* +CREG: <n>, <stat> */
-            if (debug_state) LOGI("REQUEST CREG,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x NEXTINT END %d", skip);
-            if (debug_state) LOGI("REQUEST CREG,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x NEXTINT END %d", response[0]);
-            response[1] = -1;
-            response[2] = -1;
-            if (err < 0) goto error;
-            break;
+        creg.count = unsol.count + 1;
+        creg.stat = unsol.stat;
+        creg.lac = unsol.lac;
+        creg.cid = unsol.cid;
+        creg.act = unsol.act;
+    }
 
-        case 2: /* +CREG: <stat>, <lac>, <cid> */
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT END %d", response[0]);
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT END %d", response[1]);
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x NEXTINT END %d", response[2]);
+    p_state->valid = 1;
+    p_state->stat = creg.stat;
+    p_state->lac = creg.count > 2 ? creg.lac : -1;
+    p_state->cid = creg.count > 3 ? creg.cid : -1;
+    p_state->act = creg.count > 4 ? creg.act : -1;
 
-            break;
-        case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT END %d", skip);
+    return 0;
+}
 
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT END %d", response[0]);
+/** drops the operator names; called with s_registrationMutex held */
+static void dropOperator() {
+    s_operator.valid = 0;
+    s_operator.generation++;
+}
 
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT END %d", response[1]);
+static void forgetOperator() {
+    pthread_mutex_lock(&s_registrationMutex);
+    dropOperator();
+    pthread_mutex_unlock(&s_registrationMutex);
+}
 
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x,x,x NEXTINT END %d", response[2]);
+/**
+ * Stores an unsolicited registration report
+ * returns 1 if stat, lac, cid or act differ from what was stored
+ */
+static int updateRegistration(RegistrationState *p_store,
+        const RegistrationState *p_state) {
+    int changed;
 
-            break;
-        default:
-            goto error;
-    }
-    asprintf(&responseStr[0], "%d", response[0]);
+    pthread_mutex_lock(&s_registrationMutex);
 
-    if (response[1] > 0)
-        asprintf(&responseStr[1], "%04x", response[1]);
-    else
-        responseStr[1] = NULL;
+    changed = !p_store->valid
+            || p_store->stat != p_state->stat
+            || p_store->lac != p_state->lac
+            || p_store->cid != p_state->cid
+            || p_store->act != p_state->act;
 
-    if (response[2] > 0)
-        asprintf(&responseStr[2], "%08x", response[2]);
-    else
-        responseStr[2] = NULL;
-    
-    if (count > 3) {
-        asprintf(&responseStr[3], "%d", response[3]);
-    } else if (access_technology > 0) {
-        /* Special case where we are asking for PS domain
-           registration status. Add Access technology that
-           was obtained previously to the response string */
-        asprintf(&responseStr[3], "%d", access_technology);
-        count++;
+    *p_store = *p_state;
+
+    if (changed) {
+        dropOperator();
     }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, responseStr, count * sizeof (char*));
-    at_response_free(p_response);
-    return;
+    pthread_mutex_unlock(&s_registrationMutex);
 
-error:
-    LOGE("requestRegistrationState must never return an error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
+    return changed;
 }
 
-static void requestGprsRegistrationState(void *data, size_t datalen, RIL_Token t) {
-
-    int debug_state = 0;
-    int err;
-    int response[4];
-    char * responseStr[4];
-    ATResponse *p_response = NULL;
-    const char *cmd = "AT+CGREG?";
-    const char *prefix = "+CGREG:";
-    char *line, *p;
-    int commas;
-    int skip, tmp;
-    int count = 3;
-
-    err = at_send_command_singleline(cmd, prefix, &p_response);
-
-    if (err != 0) goto error;
+/**
+ * Stores the answer to a registration query, unless a report came in
+ * while the query was out; the report is the newer of the two
+ */
+static void fillRegistration(RegistrationState *p_store,
+        const RegistrationState *p_state) {
+    pthread_mutex_lock(&s_registrationMutex);
 
-    line = p_response->p_intermediates->line;
+    if (!p_store->valid) {
+        *p_store = *p_state;
+    }
 
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
+    pthread_mutex_unlock(&s_registrationMutex);
+}
 
-    /* Ok you have to be careful here
-     * The solicited version of the CREG response is
-     * +CREG: n, stat, [lac, cid]
-     * and the unsolicited version is
-     * +CREG: stat, [lac, cid]
-     * The <n> parameter is basically "is unsolicited creg on?"
-     * which it should always be
-     *
-     * Now we should normally get the solicited version here,
-     * but the unsolicited version could have snuck in
-     * so we have to handle both
-     *
-     * Also since the LAC and CID are only reported when registered,
-     * we can have 1, 2, 3, or 4 arguments here
-     *
-     * finally, a +CGREG: answer may have a fifth value that corresponds
-     * to the network type, as in;
-     *
-     *   +CGREG: n, stat [,lac, cid [,networkType]]
-     */
+static void forgetRegistration() {
+    pthread_mutex_lock(&s_registrationMutex);
+    s_csRegistration.valid = 0;
+    s_psRegistration.valid = 0;
+    dropOperator();
+    pthread_mutex_unlock(&s_registrationMutex);
+}
 
-    /* count number of commas */
-    commas = 0;
-    for (p = line; *p != '\0'; p++) {
-        if (*p == ',') commas++;
+/**
+ * Maps a +CREG AcT value to the access technology reported to Android,
+ * falling back to the one last read from +COPS when none was reported
+ */
+static int registrationTechnology(int act) {
+    switch (act) {
+        case CGREG_ACT_GSM:
+        case CGREG_ACT_GSM_COMPACT:
+            return 1;
+        case CGREG_ACT_GSM_EGPRS:
+            return 2;
+        case CGREG_ACT_UTRAN:
+        case CGREG_ACT_UTRAN_HSDPA:
+        case CGREG_ACT_UTRAN_HSUPA:
+        case CGREG_ACT_UTRAN_HSUPA_HSDPA:
+            return 3;
+        default:
+            return access_technology;
     }
+}
 
-    if (debug_state) LOGI("REQUEST GPRS REGISTRATION STATE DEBUG");
-    switch (commas) {
-        case 0: /* +CREG: <stat> */
-            if (debug_state) LOGI("REQUEST CGREG,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x NEXTINT END %d", response[0]);
-            response[1] = -1;
-            response[2] = -1;
-            break;
-
-        case 1: /* +CREG: <n>, <stat> */
-            if (debug_state) LOGI("REQUEST CGREG,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x NEXTINT END %d", skip);
-            if (debug_state) LOGI("REQUEST CGREG,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CREG,x,x NEXTINT END %d", response[0]);
-            response[1] = -1;
-            response[2] = -1;
-            if (err < 0) goto error;
-            break;
-
-        case 2: /* +CREG: <stat>, <lac>, <cid> */
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT END %d", response[0]);
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT END %d", response[1]);
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x NEXTINT END %d", response[2]);
+/**
+ * Completes a registration request from *p_store, sending cmd only when
+ * the store holds nothing yet
+ * returns 0 on success and -1 on fail, without completing t
+ */
+static int requestRegistration(RIL_Token t, const char *cmd,
+        const char *prefix, RegistrationState *p_store) {
+    int err;
+    int count = 3;
+    int technology;
+    RegistrationState state;
+    ATResponse *p_response = NULL;
+    char stat[12];
+    char lac[12];
+    char cid[12];
+    char tech[12];
+    char *responseStr[4];
 
-            break;
-        case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT END %d", skip);
+    pthread_mutex_lock(&s_registrationMutex);
+    state = *p_store;
+    pthread_mutex_unlock(&s_registrationMutex);
 
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT START");
-            err = at_tok_nextint(&line, &response[0]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT END %d", response[0]);
+    if (!state.valid) {
+        err = at_send_command_singleline(cmd, prefix, &p_response);
 
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[1]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT END %d", response[1]);
+        if (err != 0 || p_response->success == 0) goto error;
 
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT START");
-            err = at_tok_nexthexint(&line, &response[2]);
-            if (err < 0) goto error;
-            if (debug_state) LOGI("REQUEST CGREG,x,x,x,x NEXTINT END %d", response[2]);
+        err = parseRegistrationState(p_response->p_intermediates->line,
+                1, &state);
+        if (err < 0) goto error;
 
-            break;
-        default:
-            goto error;
+        fillRegistration(p_store, &state);
+        at_response_free(p_response);
     }
-    asprintf(&responseStr[0], "%d", response[0]);
 
-    if (response[1] > 0)
-        asprintf(&responseStr[1], "%04x", response[1]);
-    else
+    snprintf(stat, sizeof(stat), "%d", state.stat);
+    responseStr[0] = stat;
+
+    if (state.lac > 0) {
+        snprintf(lac, sizeof(lac), "%04x", state.lac);
+        responseStr[1] = lac;
+    } else
         responseStr[1] = NULL;
 
-    if (response[2] > 0)
-        asprintf(&responseStr[2], "%08x", response[2]);
-    else
+    if (state.cid > 0) {
+        snprintf(cid, sizeof(cid), "%08x", state.cid);
+        responseStr[2] = cid;
+    } else
         responseStr[2] = NULL;
 
-    if (count > 3) {
-        asprintf(&responseStr[3], "%d", response[3]);
-    } else if (access_technology > 0) {
-        /* Special case where we are asking for PS domain
-           registration status. Add Access technology that
-           was obtained previously to the response string */
-        asprintf(&responseStr[3], "%d", access_technology);
+    technology = registrationTechnology(state.act);
+
+    if (technology > 0) {
+        snprintf(tech, sizeof(tech), "%d", technology);
+        responseStr[3] = tech;
         count++;
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, responseStr, count * sizeof (char*));
-    at_response_free(p_response);
-    return;
+    return 0;
 
 error:
-    LOGE("requestGPRSRegistrationState must never return an error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
+    return -1;
 }
 
-static void requestOperator(void *data, size_t datalen, RIL_Token t) {
-    int op_debug = 0;
-    if (op_debug) LOGI("REQUEST OPERATOR DEBUG");
-    int err;
-    int i;
-    int skip;
-    ATLine *p_cur;
-    char *response[3];
-    char * cmd;
-    char * line;
-
-    memset(response, 0, sizeof (response));
-
-    ATResponse *p_response = NULL;
-
-    for (i = 0; i < 3; i++) {
-
-        asprintf(&cmd, "AT+COPS=3,%d;+COPS?", i);
-        err = at_send_command_singleline(cmd, "+COPS:", &p_response);
-        free(cmd);
-
-        if (err != 0 || p_response->success == 0) goto error;
-        if (op_debug) LOGI("REQUEST OPERATOR: NO ERROR");
-
-        line = p_response->p_intermediates->line;
-
-        if (op_debug) LOGI("REQUEST OPERATOR: START START");
-        err = at_tok_start(&line);
-        if (err < 0) goto error;
-        if (op_debug) LOGI("REQUEST OPERATOR: START END");
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT START");
-
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) goto error;
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT END %d", skip);
-
-        // If we're unregistered, we may just get
-        // a "+COPS: 0" response
-        if (!at_tok_hasmore(&line)) {
-
-            if (op_debug) LOGI("REQUEST OPERATOR: UNREGISTERED, CONTINUE");
-            response[i] = NULL;
-            continue;
-        }
-
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT START");
-        err = at_tok_nextint(&line, &skip);
-        if (err < 0) goto error;
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT END %d", skip);
+static void requestRegistrationState(void *data,
+        size_t datalen, RIL_Token t) {
+    if (requestRegistration(t, "AT+CREG?", "+CREG:", &s_csRegistration) < 0) {
+        LOGE("requestRegistrationState must never return an error when radio is on");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    }
+}
 
-        // a "+COPS: 0, n" response is also possible
-        if (!at_tok_hasmore(&line)) {
-            response[i] = NULL;
-            continue;
-        }
+static void requestGprsRegistrationState(void *data, size_t datalen, RIL_Token t) {
+    if (requestRegistration(t, "AT+CGREG?", "+CGREG:", &s_psRegistration) < 0) {
+        LOGE("requestGPRSRegistrationState must never return an error when radio is on");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+    }
+}
 
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT STR START");
-        err = at_tok_nextstr(&line, &(response[i]));
-        if (err < 0) goto error;
+/**
+ * Reads the long, short and numeric operator names into names[] and the
+ * cache in one batch, and updates access_technology
+ * returns 0 on success and -1 on fail
+ */
+static int queryOperator(char names[3][OPERATOR_NAME_SIZE]) {
+    int err;
+    int i;
+    unsigned int generation;
+    COPSLine cops;
+    static const ATBatchCommand commands[] = {
+        { "AT+COPS=3,0", NO_RESULT, NULL },
+        { "AT+COPS?", SINGLELINE, "+COPS:" },
+        { "AT+COPS=3,1", NO_RESULT, NULL },
+        { "AT+COPS?", SINGLELINE, "+COPS:" },
+        { "AT+COPS=3,2", NO_RESULT, NULL },
+        { "AT+COPS?", SINGLELINE, "+COPS:" },
+    };
+    ATResponse *p_responses[6];
 
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT STR END %s", response[i]);
+    pthread_mutex_lock(&s_registrationMutex);
+    generation = s_operator.generation;
+    pthread_mutex_unlock(&s_registrationMutex);
 
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT START");
-        /* Store the access technology for later use*/
-        err = at_tok_nextint(&line, &access_technology);
-        //if (err < 0) goto error;
-        if (err < 0) access_technology = 0;
+    err = at_send_batch(commands, 6, p_responses);
 
-        if (op_debug) LOGI("REQUEST OPERATOR: NEXT INT END %d", access_technology);
+    if (err != 0) goto error;
 
-        if (access_technology == 0) {
-            if (op_debug) LOGI("REQUEST OPERATOR, ACCESS TECHNO IS %d => 1", access_technology);
-            access_technology = 1;
-        } else if (access_technology == 2) {
-            if (op_debug) LOGI("REQUEST OPERATOR, ACCESS TECHNO IS %d => 3", access_technology);
-            access_technology = 3;
-        }
+    for (i = 0; i < 3; i++) {
+        if (p_responses[2 * i]->success == 0
+            || p_responses[2 * i + 1]->success == 0) goto error;
 
-    }
+        err = parseCOPSLine(p_responses[2 * i + 1]->p_intermediates->line,
+                &cops);
+        if (err < 0) goto error;
 
+        // If we're unregistered, we may just get
+        // a "+COPS: 0" or "+COPS: 0, n" response
+        if (cops.count < 3) {
+            names[i][0] = '\0';
+            continue;
+        }
 
-    /*  err = at_send_command_multiline( */
-    /*         "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?", */
-    /*         "+COPS:", &p_response); */
+        strcpy(names[i], cops.oper);
 
-    /*     /\* we expect 3 lines here: */
-    /*      * +COPS: 0,0,"T - Mobile" */
-    /*      * +COPS: 0,1,"TMO" */
-    /*      * +COPS: 0,2,"310170" */
-    /*      *\/ */
+        /* Store the access technology for later use */
+        access_technology = registrationTechnology(
+                cops.count > 3 ? cops.act : CGREG_ACT_GSM);
+    }
 
-    /*     if (err != 0) goto error; */
+    pthread_mutex_lock(&s_registrationMutex);
 
-    /*     for (i = 0, p_cur = p_response->p_intermediates */
-    /*             ; p_cur != NULL */
-    /*             ; p_cur = p_cur->p_next, i++ */
-    /*     ) { */
-    /*         char *line = p_cur->line; */
+    if (s_operator.generation == generation) {
+        memcpy(s_operator.names, names, sizeof(s_operator.names));
+        s_operator.valid = 1;
+    }
 
-    /*         err = at_tok_start(&line); */
-    /*         if (err < 0) goto error; */
+    pthread_mutex_unlock(&s_registrationMutex);
 
-    /*         err = at_tok_nextint(&line, &skip); */
-    /*         if (err < 0) goto error; */
+    for (i = 0; i < 6; i++) {
+        at_response_free(p_responses[i]);
+    }
+    return 0;
 
-    /*         // If we're unregistered, we may just get */
-    /*         // a "+COPS: 0" response */
-    /*         if (!at_tok_hasmore(&line)) { */
-    /*             response[i] = NULL; */
-    /*             continue; */
-    /*         } */
+error:
+    for (i = 0; i < 6; i++) {
+        at_response_free(p_responses[i]);
+    }
+    return -1;
+}
 
-    /*         err = at_tok_nextint(&line, &skip); */
-    /*         if (err < 0) goto error; */
+static void requestOperator(void *data, size_t datalen, RIL_Token t) {
+    int i;
+    int valid;
+    char names[3][OPERATOR_NAME_SIZE];
+    char *response[3];
 
-    /*         // a "+COPS: 0, n" response is also possible */
-    /*         if (!at_tok_hasmore(&line)) { */
-    /*             response[i] = NULL; */
-    /*             continue; */
-    /*         } */
+    pthread_mutex_lock(&s_registrationMutex);
+    valid = s_operator.valid;
+    memcpy(names, s_operator.names, sizeof(names));
+    pthread_mutex_unlock(&s_registrationMutex);
 
-    /*         err = at_tok_nextstr(&line, &(response[i])); */
-    /*         if (err < 0) goto error; */
-    /*     } */
+    if (!valid && queryOperator(names) < 0) {
+        LOGE("requestOperator must not return error when radio is on");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
 
-    if (i != 3) {
-        /* expect 3 lines exactly */
-        if (op_debug) LOGE("REQUEST OPERATOR EXPECT 3 LINES");
-        goto error;
+    for (i = 0; i < 3; i++) {
+        response[i] = names[i][0] != '\0' ? names[i] : NULL;
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof (response));
-    at_response_free(p_response);
-    return;
-
-error:
-    LOGE("requestOperator must not return error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
 }
 
 static void requestSendSMS(void *data, size_t datalen, RIL_Token t) {
@@ -1794,7 +2126,9 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t) {
     const char *smsc;
     const char *pdu;
     int tpLayerLength;
-    char *cmd1, *cmd2;
+    char buf[AT_CMD_MAX];
+    char pduBuf[AT_CMD_MAX];
+    ATCmd cmd, smscPdu;
     RIL_SMS_Response response;
     ATResponse *p_response = NULL;
 
@@ -1808,10 +2142,17 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t) {
         smsc = "00";
     }
 
-    asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
-    asprintf(&cmd2, "%s%s", smsc, pdu);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CMGS=");
+    at_cmd_int(&cmd, tpLayerLength);
 
-    err = at_send_command_sms(cmd1, cmd2, "+CMGS:", &p_response);
+    at_cmd_start(&smscPdu, pduBuf, sizeof(pduBuf), smsc);
+    at_cmd_append(&smscPdu, pdu);
+
+    // the PDU goes out after the prompt and must not be NULL
+    if (at_cmd_end(&smscPdu) == NULL) goto error;
+
+    err = at_send_command_sms(at_cmd_end(&cmd), pduBuf, "+CMGS:",
+            &p_response);
 
     if (err != 0 || p_response->success == 0) goto error;
 
@@ -2024,16 +2365,18 @@ error:
 
 static void requestDeactivateDeactivateDataCall(void *data, size_t datalen, RIL_Token t) {
     int err;
-    char * cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     char * cid;
     ATResponse *p_response = NULL;
 
     cid = ((char **) data)[0];
 
-    asprintf(&cmd, "AT+CGACT=0,%s", cid);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CGACT=");
+    at_cmd_int(&cmd, 0);
+    at_cmd_param(&cmd, cid);
 
-    err = at_send_command(cmd, &p_response);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), &p_response);
 
     if (err < 0 || p_response->success == 0) {
         goto error;
@@ -2075,9 +2418,10 @@ static void requestSIM_IO(void *data, size_t datalen, RIL_Token t) {
     ATResponse *p_response = NULL;
     RIL_SIM_IO_Response sr;
     int err;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     RIL_SIM_IO *p_args;
-    char *line;
+    CRSMLine crsm;
 
     memset(&sr, 0, sizeof (sr));
 
@@ -2085,66 +2429,63 @@ static void requestSIM_IO(void *data, size_t datalen, RIL_Token t) {
 
     /* FIXME handle pin2 */
 
-    if (p_args->data == NULL) {
-        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d",
-                p_args->command, p_args->fileid,
-                p_args->p1, p_args->p2, p_args->p3);
-    } else {
-        asprintf(&cmd, "AT+CRSM=%d,%d,%d,%d,%d,%s",
-                p_args->command, p_args->fileid,
-                p_args->p1, p_args->p2, p_args->p3, p_args->data);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CRSM=");
+    at_cmd_int(&cmd, p_args->command);
+    at_cmd_int(&cmd, p_args->fileid);
+    at_cmd_int(&cmd, p_args->p1);
+    at_cmd_int(&cmd, p_args->p2);
+    at_cmd_int(&cmd, p_args->p3);
+
+    if (p_args->data != NULL) {
+        at_cmd_param(&cmd, p_args->data);
     }
 
-    err = at_send_command_singleline(cmd, "+CRSM:", &p_response);
+    err = at_send_command_singleline(at_cmd_end(&cmd), "+CRSM:",
+            &p_response);
 
     if (err < 0 || p_response->success == 0) {
         goto error;
     }
 
-    line = p_response->p_intermediates->line;
-
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
-
-    err = at_tok_nextint(&line, &(sr.sw1));
+    err = parseCRSMLine(p_response->p_intermediates->line, &crsm);
     if (err < 0) goto error;
 
-    err = at_tok_nextint(&line, &(sr.sw2));
-    if (err < 0) goto error;
+    sr.sw1 = crsm.sw1;
+    sr.sw2 = crsm.sw2;
 
-    if (at_tok_hasmore(&line)) {
-        err = at_tok_nextstr(&line, &(sr.simResponse));
-        if (err < 0) goto error;
+    if (crsm.count > 2) {
+        sr.simResponse = crsm.data;
     }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof (sr));
     at_response_free(p_response);
-    free(cmd);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
-    free(cmd);
 
 }
 
 static void requestEnterSimPin(void* data, size_t datalen, RIL_Token t) {
     ATResponse *p_response = NULL;
     int err;
-    char* cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     const char** strings = (const char**) data;
     ;
 
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CPIN=");
+
     if (datalen == sizeof (char*)) {
-        asprintf(&cmd, "AT+CPIN=\"%s\"", strings[0]);
+        at_cmd_quoted(&cmd, strings[0]);
     } else if (datalen == 2 * sizeof (char*)) {
-        asprintf(&cmd, "AT+CPIN=\"%s\",\"%s\"", strings[0], strings[1]);
+        at_cmd_quoted(&cmd, strings[0]);
+        at_cmd_quoted(&cmd, strings[1]);
     } else
         goto error;
 
-    err = at_send_command(cmd, &p_response);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), &p_response);
 
     if (err < 0 || p_response->success == 0) {
 error:
@@ -2210,27 +2551,107 @@ error:
     LOGE("Invalid NITZ line %s\n", s);
 }
 
+static long long monotonicMsec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** is rssi far enough from what Android was last told to be reported */
+static int signalChanged(int rssi) {
+    if (rssi == 99 || s_signal.reportedRssi == 99) {
+        return rssi != s_signal.reportedRssi;
+    }
+
+    return abs(rssi - s_signal.reportedRssi) >= SIGNAL_HYSTERESIS;
+}
+
+/**
+ * fills response with the cached signal strength and records it as
+ * reported; called with s_signalMutex held
+ */
+static void reportSignalStrengthLocked(int response[2]) {
+    response[0] = s_signal.rssi;
+    response[1] = s_signal.ber;
+
+    s_signal.reportedRssi = s_signal.rssi;
+    s_signal.reportedAt = monotonicMsec();
+}
+
+/** timed callback for a report held back by SIGNAL_REPORT_INTERVAL */
+static void reportSignalStrength(void *param) {
+    int send;
+    int response[2];
+
+    pthread_mutex_lock(&s_signalMutex);
+
+    s_signal.pending = 0;
+
+    // the signal may have gone back to what was reported meanwhile
+    send = signalChanged(s_signal.rssi);
+    if (send) {
+        reportSignalStrengthLocked(response);
+    }
+
+    pthread_mutex_unlock(&s_signalMutex);
+
+    if (send) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH,
+                response, sizeof (response));
+    }
+}
+
+static void forgetSignalStrength() {
+    pthread_mutex_lock(&s_signalMutex);
+    s_signal.reporting = 0;
+    s_signal.rssi = 99;
+    s_signal.ber = 99;
+    s_signal.reportedRssi = 99;
+    pthread_mutex_unlock(&s_signalMutex);
+}
+
 static void unsolicitedRSSI(const char * s) {
-    int err;
+    XCIEVLine xciev;
+    int send = 0;
+    int schedule = 0;
     int response[2];
-    char * line = NULL;
+    long long wait;
+    struct timeval delay;
 
-    line = strdup(s);
+    if (parseXCIEVLine(s, &xciev) < 0) {
+        /* The notification was for a battery event - do not send a msg to upper layers */
+        return;
+    }
 
-    at_tok_start(&line);
+    pthread_mutex_lock(&s_signalMutex);
 
-    err = at_tok_nextint(&line, &(at_csq_rssi));
-    if (err < 0) goto error;
+    s_signal.reporting = 1;
+    s_signal.rssi = idccRSSITo3gpp(xciev.rssi);
 
-    response[0] = idccRSSITo3gpp(at_csq_rssi);
-    response[1] = at_csq_ber;
+    if (signalChanged(s_signal.rssi) && !s_signal.pending) {
+        wait = s_signal.reportedAt + SIGNAL_REPORT_INTERVAL - monotonicMsec();
 
-    RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH, response, sizeof (response));
-    return;
+        if (wait <= 0) {
+            reportSignalStrengthLocked(response);
+            send = 1;
+        } else {
+            s_signal.pending = 1;
+            schedule = 1;
+            delay.tv_sec = wait / 1000;
+            delay.tv_usec = (wait % 1000) * 1000;
+        }
+    }
 
-error:
-    /* The notification was for a battery event - do not send a msg to upper layers */
-    return;
+    pthread_mutex_unlock(&s_signalMutex);
+
+    if (send) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH,
+                response, sizeof (response));
+    } else if (schedule) {
+        RIL_requestTimedCallback(reportSignalStrength, NULL, &delay);
+    }
 }
 
 static void requestNotSupported(RIL_Token t) {
@@ -2246,16 +2667,20 @@ static void requestOEMHookRaw(void *data, size_t datalen, RIL_Token t) {
 static void requestQueryCallWaiting(void *data, size_t datalen, RIL_Token t) {
     ATResponse *p_response = NULL;
     int err;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     char *line;
     int class;
     int response[2];
 
     class = ((int *) data)[0];
 
-    asprintf(&cmd, "AT+CCWA=1,2,%d", class);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CCWA=");
+    at_cmd_int(&cmd, 1);
+    at_cmd_int(&cmd, 2);
+    at_cmd_int(&cmd, class);
 
-    err = at_send_command_singleline(cmd, "+CCWA:", &p_response);
+    err = at_send_command_singleline(at_cmd_end(&cmd), "+CCWA:", &p_response);
 
     if (err < 0 || p_response->success == 0) goto error;
 
@@ -2274,19 +2699,18 @@ static void requestQueryCallWaiting(void *data, size_t datalen, RIL_Token t) {
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof (response));
     at_response_free(p_response);
-    free(cmd);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
-    free(cmd);
 }
 
 static void requestSetCallWaiting(void *data, size_t datalen, RIL_Token t) {
     ATResponse *p_response = NULL;
     int err;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     int enabled, class;
 
     if ((datalen < 2) || (data == NULL)) goto error;
@@ -2294,32 +2718,32 @@ static void requestSetCallWaiting(void *data, size_t datalen, RIL_Token t) {
     enabled = ((int *) data)[0];
     class = ((int *) data)[1];
 
-    asprintf(&cmd, "AT+CCWA=0,%d,%d", enabled, class);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CCWA=");
+    at_cmd_int(&cmd, 0);
+    at_cmd_int(&cmd, enabled);
+    at_cmd_int(&cmd, class);
 
-    err = at_send_command(cmd, NULL);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
     if (err < 0) goto error;
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     at_response_free(p_response);
-    free(cmd);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
-    free(cmd);
 }
 
 static void requestQueryCallForwardStatus(RIL_Token t) {
     int err = 0;
     int i = 0;
     int n = 0;
-    int tmp = 0;
     ATResponse *p_response = NULL;
     ATLine *p_cur;
     RIL_CallForwardInfo **responses = NULL;
-    char *cmd;
+    CCFCLine *p_lines;
 
     err = at_send_command_multiline("AT+CCFC=0,2", "+CCFC:", &p_response);
 
@@ -2330,6 +2754,7 @@ static void requestQueryCallForwardStatus(RIL_Token t) {
         n++;
 
     responses = alloca(n * sizeof (RIL_CallForwardInfo *));
+    p_lines = alloca(n * sizeof (CCFCLine));
 
     for (i = 0; i < n; i++) {
         responses[i] = alloca(sizeof (RIL_CallForwardInfo));
@@ -2342,37 +2767,19 @@ static void requestQueryCallForwardStatus(RIL_Token t) {
     }
 
     for (i = 0, p_cur = p_response->p_intermediates; p_cur != NULL; p_cur = p_cur->p_next, i++) {
-        char *line = p_cur->line;
+        CCFCLine *ccfc = p_lines + i;
 
-        err = at_tok_start(&line);
+        err = parseCCFCLine(p_cur->line, ccfc);
         if (err < 0) goto error;
 
-        err = at_tok_nextint(&line, &(responses[i]->status));
-        if (err < 0) goto error;
-
-        err = at_tok_nextint(&line, &(responses[i]->serviceClass));
-        if (err < 0) goto error;
-
-        if (!at_tok_hasmore(&line)) continue;
-
-        err = at_tok_nextstr(&line, &(responses[i]->number));
-        if (err < 0) goto error;
-
-        if (!at_tok_hasmore(&line)) continue;
-
-        err = at_tok_nextint(&line, &(responses[i]->toa));
-        if (err < 0) goto error;
-
-        if (!at_tok_hasmore(&line)) continue;
-        at_tok_nextint(&line, &tmp);
-
-        if (!at_tok_hasmore(&line)) continue;
-        at_tok_nextint(&line, &tmp);
-
-        if (!at_tok_hasmore(&line)) continue;
-        err = at_tok_nextint(&line, &(responses[i]->timeSeconds));
-        if (err < 0) goto error;
+        responses[i]->status = ccfc->status;
+        responses[i]->serviceClass = ccfc->class;
+        responses[i]->toa = ccfc->toa;
+        responses[i]->timeSeconds = ccfc->time;
 
+        if (ccfc->count > 2) {
+            responses[i]->number = ccfc->number;
+        }
     }
 
     at_response_free(p_response);
@@ -2386,28 +2793,28 @@ error:
 
 static void requestSetCallForward(void *data, RIL_Token t) {
     int err = 0;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     RIL_CallForwardInfo *info = NULL;
 
     info = ((RIL_CallForwardInfo *) data);
 
     if (data == NULL) goto error;
 
-    asprintf(&cmd, "AT+CCFC = %d, %d, \"%s\"",
-            info->reason, info->status,
-            info->number);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CCFC=");
+    at_cmd_int(&cmd, info->reason);
+    at_cmd_int(&cmd, info->status);
+    at_cmd_quoted(&cmd, info->number);
 
-    err = at_send_command(cmd, NULL);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
     if (err < 0) goto error;
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-    free(cmd);
     return;
 
 error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    free(cmd);
 }
 
 static void requestGetCLIR(void *data, size_t datalen, RIL_Token t) {
@@ -2443,13 +2850,14 @@ error:
 }
 
 static void requestSetCLIR(void *data, size_t datalen, RIL_Token t) {
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     int err = 0;
 
-    asprintf(&cmd, "AT+CLIR=%d", ((int *) data)[0]);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CLIR=");
+    at_cmd_int(&cmd, ((int *) data)[0]);
 
-    err = at_send_command(cmd, NULL);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
     if (err < 0)
         RIL_onRequestComplete(t, RIL_E_PASSWORD_INCORRECT, NULL, 0);
@@ -2458,10 +2866,7 @@ static void requestSetCLIR(void *data, size_t datalen, RIL_Token t) {
 }
 
 static void requestSendSMSExpectMore(void *data, size_t datalen, RIL_Token t) {
-    char *cmd = NULL;
-    asprintf(&cmd, "AT+CMMS=1");
-    at_send_command(cmd, NULL);
-    free(cmd);
+    at_send_command("AT+CMMS=1", NULL);
     requestSendSMS(data, datalen, t);
 }
 
@@ -2472,15 +2877,18 @@ static void requestSendUSSD(void *data, size_t datalen, RIL_Token t) {
     char *line = NULL;
     char *ussdstring = NULL;
     char *string = NULL;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     int n = 0;
     int dcs = 0;
 
     ussdstring = (char *) data;
     length = strlen(ussdstring);
 
-    asprintf(&cmd, "AT+CUSD=%d, \"%s\"", 1, ussdstring);
-    err = at_send_command_singleline(cmd, "+CUSD:", &p_response);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CUSD=");
+    at_cmd_int(&cmd, 1);
+    at_cmd_quoted(&cmd, ussdstring);
+    err = at_send_command_singleline(at_cmd_end(&cmd), "+CUSD:", &p_response);
 
     if (err < 0 || p_response->success == 0) goto error;
 
@@ -2515,7 +2923,8 @@ static void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t) {
      * requestQueryFacilityLock to obtain the previus value
      */
     int err = 0;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     char *code = NULL;
     char *lock = NULL;
     char *password = NULL;
@@ -2528,11 +2937,14 @@ static void requestSetFacilityLock(void *data, size_t datalen, RIL_Token t) {
     password = ((char **) data)[2];
     class = ((char **) data)[3];
 
-    asprintf(&cmd, "AT+CLCK=\"%s\",%s,\"%s\",%s", code, lock, password, class);
-    err = at_send_command(cmd, NULL);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CLCK=");
+    at_cmd_quoted(&cmd, code);
+    at_cmd_param(&cmd, lock);
+    at_cmd_quoted(&cmd, password);
+    at_cmd_param(&cmd, class);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
     if (err < 0) goto error;
 
-    free(cmd);
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     return;
 
@@ -2542,7 +2954,8 @@ error:
 
 static void requestChangeBarringPassword(void *data, size_t datalen, RIL_Token t) {
     int err = 0;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     char *string = NULL;
     char *old_password = NULL;
     char *new_password = NULL;
@@ -2553,10 +2966,12 @@ static void requestChangeBarringPassword(void *data, size_t datalen, RIL_Token t
     old_password = ((char **) data)[1];
     new_password = ((char **) data)[2];
 
-    asprintf(&cmd, "AT+CPWD=\"%s\",\"%s\",\"%s\"", string, old_password, new_password);
-    err = at_send_command(cmd, NULL);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CPWD=");
+    at_cmd_quoted(&cmd, string);
+    at_cmd_quoted(&cmd, old_password);
+    at_cmd_quoted(&cmd, new_password);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
 
-    free(cmd);
 
     if (err < 0) goto error;
 
@@ -2569,21 +2984,26 @@ error:
 
 static void requestSetNetworkSelectionManual(void *data, size_t datalen, RIL_Token t) {
     char *operator = NULL;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     int err = 0;
     ATResponse *p_response = NULL;
 
     operator = (char *) data;
-    asprintf(&cmd, "AT+COPS=1,2,\"%s\"", operator);
-    err = at_send_command(cmd, &p_response);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+COPS=");
+    at_cmd_int(&cmd, 1);
+    at_cmd_int(&cmd, 2);
+    at_cmd_quoted(&cmd, operator);
+    err = at_send_command(at_cmd_end(&cmd), &p_response);
     if (err < 0 || p_response->success == 0) {
         err = at_send_command("AT+COPS=0", NULL);
         if (err < 0) goto error;
     }
 
+    forgetOperator();
+
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     at_response_free(p_response);
-    free(cmd);
     return;
 
 error:
@@ -2635,12 +3055,14 @@ static void requestResetRadio(RIL_Token t) {
 static void requestSetSuppSVCNotification(void *data, size_t datalen, RIL_Token t) {
     int err = 0;
     int enabled = 0;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     enabled = ((int *) data)[0];
 
-    asprintf(&cmd, "AT+CSSN=%d,%d", enabled, enabled);
-    err = at_send_command(cmd, NULL);
-    free(cmd);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CSSN=");
+    at_cmd_int(&cmd, enabled);
+    at_cmd_int(&cmd, enabled);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
     if (err < 0)
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
@@ -2659,13 +3081,22 @@ static void requestExplicitCallTransfer(RIL_Token t) {
 static void requestSetLocationUpdates(void *data, size_t datalen, RIL_Token t) {
     int err = 0;
     int updates = 0;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     ATResponse *p_response = NULL;
     updates = ((int *) data)[0] == 1 ? 2 : 1;
 
-    asprintf(&cmd, "AT+CREG=%d", updates);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CREG=");
+    at_cmd_int(&cmd, updates);
+
+    err = at_send_command_singleline(at_cmd_end(&cmd), "+CLIP:", &p_response);
+
+    /* with +CREG=1 cell changes went unreported, and turning +CREG=2
+       back on reports nothing until the next change */
+    pthread_mutex_lock(&s_registrationMutex);
+    s_csRegistration.valid = 0;
+    pthread_mutex_unlock(&s_registrationMutex);
 
-    err = at_send_command_singleline(cmd, "+CLIP:", &p_response);
     if (err < 0 || p_response->success == 0) goto error;
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
@@ -2712,14 +3143,16 @@ static void requestSTKSetProfile(void * data, size_t datalen, RIL_Token t) {
     int err = 0;
     int length = 0;
     char *profile = NULL;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
 
     profile = (char *) data;
     length = strlen(profile);
-    asprintf(&cmd, "AT+STKPROF=%d,\"%s\"", length, profile);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKPROF=");
+    at_cmd_int(&cmd, length);
+    at_cmd_quoted(&cmd, profile);
 
-    err = at_send_command(cmd, NULL);
-    free(cmd);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
     if (err < 0)
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
@@ -2844,78 +3277,44 @@ static void requestSeparateConnection(void * data, size_t datalen, RIL_Token t)
 
 static void requestDTMF(void * data, size_t datalen, RIL_Token t) {
     int err = 0;
-    char c = ((char *) data)[0];
-    char *cmd;
+    char c[2] = { ((char *) data)[0], '\0' };
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
 
-    asprintf(&cmd, "AT+VTS=%c", (int) c);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+VTS=");
+    at_cmd_append(&cmd, c);
 
-    err = at_send_command(cmd, NULL);
+    err = at_send_command(at_cmd_end(&cmd), NULL);
     if (err < 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     } else {
         RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     }
-
-    free(cmd);
     return;
 }
 
 static void requestGetIMSI(RIL_Token t) {
-    ATResponse *p_response = NULL;
-    char *imsi;
-    char *line;
-    char *response;
-    char *part;
-    int err;
+    char imsi[IDENTITY_SIZE];
 
-    int loop = 0;
-    int success = 0;
-    /* We are looping here because the command fails on the first try.
-        What needs to be done, is to trap the "+CME ERROR: 14" which means
-        SIM BUSY and retry that. As a workaround for now, simply try, wait
-        1 second, and try again, until a valid result is obtained. Usually only
-        takes 2 tries.
-     */
-    while (loop < 10) {
-        err = at_send_command_numeric("AT+CIMI", &p_response);
-        if (err < 0 || p_response->success == 0) {
-            sleep(1);
-            loop++;
-        } else {
-            loop = 10;
-            success = 1;
-        }
+    if (getIdentity(s_identity.imsi, imsi) < 0
+            && queryIMSI(imsi) < 0) {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
     }
 
-    /*             if (err < 0 || p_response->success == 0 ) */
-    if (success == 0)
-        goto error;
-    imsi = strdup(p_response->p_intermediates->line);
-
     RIL_onRequestComplete(t, RIL_E_SUCCESS, imsi, sizeof (char *));
-    free(imsi);
-    at_response_free(p_response);
-    return;
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
 }
 
 static void requestGetIMEISV(RIL_Token t) {
-    int err = 0;
-    ATResponse *p_response = NULL;
-
-    err = at_send_command_numeric("AT+CGSN", &p_response);
+    char imei[IDENTITY_SIZE];
 
-    if (err < 0 || p_response->success == 0) {
+    if (getIdentity(s_identity.imei, imei) < 0
+            && queryIMEI(imei) < 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    } else {
-        RIL_onRequestComplete(t, RIL_E_SUCCESS,
-                p_response->p_intermediates->line, sizeof (char *));
+        return;
     }
 
-    at_response_free(p_response);
-    return;
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, imei, sizeof (char *));
 }
 
 static void requestCancelUSSD(RIL_Token t) {
@@ -2939,6 +3338,8 @@ static void requestSetNetworkSelectionAutomatic(RIL_Token t) {
     int err = 0;
 
     err = at_send_command("AT+COPS=0", NULL);
+    forgetOperator();
+
     if (err < 0)
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     else
@@ -2964,19 +3365,20 @@ static void requestOEMHookStrings(void * data, size_t datalen, RIL_Token t) {
 
 static void requestDeleteSMSOnSIM(void * data, size_t datalen, RIL_Token t) {
     int err = 0;
-    char * cmd;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     ATResponse *p_response = NULL;
 
-    asprintf(&cmd, "AT+CMGD=%d", ((int *) data)[0]);
+    at_cmd_start(&cmd, buf, sizeof(buf), "AT+CMGD=");
+    at_cmd_int(&cmd, ((int *) data)[0]);
 
-    err = at_send_command(cmd, &p_response);
+    err = at_send_command(at_cmd_end(&cmd), &p_response);
     if (err < 0 || p_response->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     } else {
         RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     }
 
-    free(cmd);
     at_response_free(p_response);
     return;
 }
@@ -2990,7 +3392,8 @@ static void requestSTKSendEnvelopeCommand(void * data, size_t datalen, RIL_Token
     int eventlst = 0;
     int lang_cause = 0;
     char *hexdata = (char *) data;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     unsigned int *intdata = NULL;
 
     len = strlen(data);
@@ -3003,16 +3406,22 @@ static void requestSTKSendEnvelopeCommand(void * data, size_t datalen, RIL_Token
     if (envcmd == 211) {
         itemid = intdata[8];
         helpreq = intdata[9];
-        asprintf(&cmd, "AT+STKENV=%d, %d, %d", envcmd, itemid, helpreq);
-        err = at_send_command(cmd, NULL);
+        at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKENV=");
+        at_cmd_int(&cmd, envcmd);
+        at_cmd_int(&cmd, itemid);
+        at_cmd_int(&cmd, helpreq);
+        err = at_send_command(at_cmd_end(&cmd), NULL);
         if (err < 0)
             goto error;
     } else if (envcmd == 214) {
         len = intdata[1];
         eventlst = intdata[4];
         if (len > 7) lang_cause = intdata[9];
-        asprintf(&cmd, "AT+STKENV=%d, %d, %d", envcmd, eventlst, lang_cause);
-        err = at_send_command(cmd, NULL);
+        at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKENV=");
+        at_cmd_int(&cmd, envcmd);
+        at_cmd_int(&cmd, eventlst);
+        at_cmd_int(&cmd, lang_cause);
+        err = at_send_command(at_cmd_end(&cmd), NULL);
         if (err < 0)
             goto error;
 
@@ -3020,19 +3429,16 @@ static void requestSTKSendEnvelopeCommand(void * data, size_t datalen, RIL_Token
         goto notsupported;
     }
 
-    free(cmd);
     free(intdata);
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     return;
 
 notsupported:
-    free(cmd);
     free(intdata);
     RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
     return;
 
 error:
-    free(cmd);
     free(intdata);
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     return;
@@ -3050,7 +3456,8 @@ static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Toke
     char *optInfo = NULL;
     int i = 0;
     char *hexdata = (char *) data;
-    char *cmd = NULL;
+    char buf[AT_CMD_MAX];
+    ATCmd cmd;
     unsigned int *intdata = NULL;
 
     len = strlen(data);
@@ -3089,8 +3496,11 @@ static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Toke
             result = intdata[11];
             if (intdata[10] > 1)
                 additionalInfo = intdata[12];
-            asprintf(&cmd, "AT+STKTR=%d, %d, %d", command, result, additionalInfo);
-            err = at_send_command(cmd, NULL);
+            at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKTR=");
+            at_cmd_int(&cmd, command);
+            at_cmd_int(&cmd, result);
+            at_cmd_int(&cmd, additionalInfo);
+            err = at_send_command(at_cmd_end(&cmd), NULL);
             if (err < 0)
                 goto error;
             break;
@@ -3098,8 +3508,10 @@ static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Toke
         case 21:
         {
             result = intdata[11];
-            asprintf(&cmd, "AT+STKTR=%d, %d", command, result);
-            err = at_send_command(cmd, NULL);
+            at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKTR=");
+            at_cmd_int(&cmd, command);
+            at_cmd_int(&cmd, result);
+            err = at_send_command(at_cmd_end(&cmd), NULL);
             if (err < 0)
                 goto error;
             break;
@@ -3118,9 +3530,15 @@ static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Toke
             for (i = 0; i < optInfoLen; i++)
                 optInfo[i] = hexdata[15 + offset + i];
 
-            asprintf(&cmd, "AT+STKTR=%d, %d, %d, 0, %d,\"%s\"", command, result, additionalInfo, intdata[14 + offset], optInfo);
+            at_cmd_start(&cmd, buf, sizeof(buf), "AT+STKTR=");
+            at_cmd_int(&cmd, command);
+            at_cmd_int(&cmd, result);
+            at_cmd_int(&cmd, additionalInfo);
+            at_cmd_int(&cmd, 0);
+            at_cmd_int(&cmd, intdata[14 + offset]);
+            at_cmd_quoted(&cmd, optInfo);
 
-            err = at_send_command(cmd, NULL);
+            err = at_send_command(at_cmd_end(&cmd), NULL);
             if (err < 0)
                 goto error;
 
@@ -3128,21 +3546,18 @@ static void requestSTKSendTerminalResponse(void * data, size_t datalen, RIL_Toke
         }
     }
 
-    free(cmd);
     free(intdata);
     free(optInfo);
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
     return;
 
 notsupported:
-    free(cmd);
     free(intdata);
     free(optInfo);
     RIL_onRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
     return;
 
 error:
-    free(cmd);
     free(intdata);
     free(optInfo);
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -3546,6 +3961,11 @@ setRadioState(RIL_RadioState newState) {
             onSIMReady();
         } else if (sState == RADIO_STATE_SIM_NOT_READY) {
             onRadioPowerOn();
+        } else if (sState == RADIO_STATE_OFF
+                || sState == RADIO_STATE_UNAVAILABLE) {
+            forgetRegistration();
+            forgetSignalStrength();
+            forgetCallState();
         }
     }
 }
@@ -3720,6 +4140,10 @@ static void pollSIMState(void *param) {
 
     switch (getSIMStatus()) {
         case SIM_ABSENT:
+            forgetIdentity(0);
+            setRadioState(RADIO_STATE_SIM_LOCKED_OR_ABSENT);
+            return;
+
         case SIM_PIN:
         case SIM_PUK:
         case SIM_NETWORK_PERSONALIZATION:
@@ -3773,8 +4197,26 @@ error:
  * Initialize everything that can be configured while we're still in
  * AT+CFUN=0
  */
+static const ATBatchCommand s_initCommands[] = {
+    /*  atchannel is tolerant of echo but it must */
+    /*  have verbose result codes */
+    { "ATE0", NO_RESULT, NULL },
+    { "ATQ0", NO_RESULT, NULL },
+    { "ATV1", NO_RESULT, NULL },
+
+    /*  No auto-answer */
+    //{ "ATS0=0", NO_RESULT, NULL },
+
+    { "AT+CGCLASS=\"CG\"", NO_RESULT, NULL },
+    { "AT+FCLASS=0", NO_RESULT, NULL },
+
+    /*  Extended errors */
+    { "AT+CMEE=1", NO_RESULT, NULL },
+};
+
 static void initializeCallback(void *param) {
     ATResponse *p_response = NULL;
+    char identity[IDENTITY_SIZE];
     int err;
 
     setRadioState(RADIO_STATE_OFF);
@@ -3787,20 +4229,9 @@ static void initializeCallback(void *param) {
     LOGI("############ Resetting modem to factory defaults");
     at_send_command("AT&F", NULL);
 
-    /*  atchannel is tolerant of echo but it must */
-    /*  have verbose result codes */
-    at_send_command("ATE0", NULL);
-    at_send_command("ATQ0", NULL);
-    at_send_command("ATV1", NULL);
-
-    /*  No auto-answer */
-    //at_send_command("ATS0=0", NULL);
-
-    at_send_command("AT+CGCLASS=\"CG\"", NULL);
-    at_send_command("AT+FCLASS=0", NULL);
-
-    /*  Extended errors */
-    at_send_command("AT+CMEE=1", NULL);
+    /* these go out as one command line */
+    at_send_batch(s_initCommands,
+            sizeof(s_initCommands) / sizeof(s_initCommands[0]), NULL);
 
     /*  Network registration events */
     err = at_send_command("AT+CREG=2", &p_response);
@@ -3838,6 +4269,11 @@ static void initializeCallback(void *param) {
 #endif /* USE_TI_COMMANDS */
 
 
+    /* the identity of this modem, for the life of the channel */
+    forgetIdentity(1);
+    queryModel(identity);
+    queryIMEI(identity);
+
     /* assume radio is off on error */
     if (isRadioOn() > 0) {
         setRadioState(RADIO_STATE_SIM_NOT_READY);
@@ -3854,10 +4290,35 @@ static void waitForClose() {
     pthread_mutex_unlock(&s_state_mutex);
 }
 
+/**
+ * Stores an unsolicited +CREG: or +CGREG: line
+ * returns 1 if the framework should be told the network state changed
+ */
+static int onRegistrationReport(const char *s) {
+    RegistrationState state;
+    RegistrationState *p_store;
+
+    p_store = strStartsWith(s, "+CGREG:") ? &s_psRegistration
+            : &s_csRegistration;
+
+    if (parseRegistrationState(s, 0, &state) < 0) {
+        /* let the next request ask the modem */
+        pthread_mutex_lock(&s_registrationMutex);
+        p_store->valid = 0;
+        dropOperator();
+        pthread_mutex_unlock(&s_registrationMutex);
+
+        return 1;
+    }
+
+    return updateRegistration(p_store, &state);
+}
+
 /**
  * Called by atchannel when an unsolicited line appears
- * This is called on atchannel's reader thread. AT commands may
- * not be issued here
+ * This is called on atchannel's unsolicited dispatch thread.
+ * Blocking here delays later unsolicited responses, so AT commands
+ * should still be issued from a timed callback
  */
 static void onUnsolicited(const char *s, const char *sms_pdu) {
     char *line = NULL;
@@ -3878,10 +4339,10 @@ static void onUnsolicited(const char *s, const char *sms_pdu) {
             || strStartsWith(s, "RING")
             || strStartsWith(s, "NO CARRIER")
             || strStartsWith(s, "+CCWA")
+            || strStartsWith(s, "+XCALLSTAT:")
             ) {
-        RIL_onUnsolicitedResponse(
-                RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
-                NULL, 0);
+        /* can't issue AT commands here -- call on main thread */
+        onCallProgress();
 #ifdef WORKAROUND_FAKE_CGEV
         RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL); //TODO use new function
 #endif /* WORKAROUND_FAKE_CGEV */
@@ -3890,12 +4351,14 @@ static void onUnsolicited(const char *s, const char *sms_pdu) {
     } else if (strStartsWith(s, "+CREG:")
             || strStartsWith(s, "+CGREG:")
             ) {
-        RIL_onUnsolicitedResponse(
-                RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
-                NULL, 0);
+        if (onRegistrationReport(s)) {
+            RIL_onUnsolicitedResponse(
+                    RIL_UNSOL_RESPONSE_NETWORK_STATE_CHANGED,
+                    NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
-        RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL);
+            RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL);
 #endif /* WORKAROUND_FAKE_CGEV */
+        }
     } else if (strStartsWith(s, "+CMT:")) {
         RIL_onUnsolicitedResponse(
                 RIL_UNSOL_RESPONSE_NEW_SMS,
@@ -3923,16 +4386,20 @@ static void onATReaderClosed() {
     LOGI("AT channel closed\n");
     at_close();
     s_closed = 1;
+    forgetIdentity(1);
+    forgetRegistration();
 
     setRadioState(RADIO_STATE_UNAVAILABLE);
 }
 
-/* Called on command thread */
+/* Called on command or reader thread */
 static void onATTimeout() {
     LOGI("AT channel timeout; closing\n");
     at_close();
 
     s_closed = 1;
+    forgetIdentity(1);
+    forgetRegistration();
 
     /* FIXME cause a radio reset here */
 
@@ -3941,17 +4408,44 @@ static void onATTimeout() {
 
 static void usage(char *s) {
 #ifdef RIL_SHLIB
-    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n");
+    fprintf(stderr, "reference-ril requires: -p <tcp port> or -d /dev/tty_device\n"
+            "optional: -n <AT pipeline depth> -a (adaptive AT timeouts)"
+            " -m (CMUX) -u /dev/tty_notification_device\n");
 #else
-    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]\n", s);
+    fprintf(stderr, "usage: %s [-p <tcp port>] [-d /dev/tty_device]"
+            " [-n <AT pipeline depth>] [-a] [-m]"
+            " [-u /dev/tty_notification_device]\n", s);
     exit(-1);
 #endif
 }
 
+static int openTty(const char *path) {
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        LOGI("Setting speed");
+        /* disable echo on serial ports */
+        struct termios ios;
+        tcgetattr(fd, &ios);
+        ios.c_lflag = 0; /* disable ECHO, ICANON, etc... */
+        if (cfsetispeed(&ios, B115200) != 0)
+            LOGE("Failed to set in speed");
+        if (cfsetospeed(&ios, B115200) != 0)
+            LOGE("Failed to set out speed");
+        tcsetattr(fd, TCSANOW, &ios);
+    }
+
+    return fd;
+}
+
 static void *
 mainLoop(void *param) {
     int fd;
     int ret;
+    int muxed;
+    int dlc[3];
+    int notifyFd;
 
     AT_DUMP("== ", "entering mainLoop()", -1);
     at_set_on_reader_closed(onATReaderClosed);
@@ -3967,19 +4461,7 @@ mainLoop(void *param) {
                         ANDROID_SOCKET_NAMESPACE_FILESYSTEM,
                         SOCK_STREAM);
             } else if (s_device_path != NULL) {
-                fd = open(s_device_path, O_RDWR);
-                if (fd >= 0) {
-                    LOGI("Setting speed");
-                    /* disable echo on serial ports */
-                    struct termios ios;
-                    tcgetattr(fd, &ios);
-                    ios.c_lflag = 0; /* disable ECHO, ICANON, etc... */
-                    if (cfsetispeed(&ios, B115200) != 0)
-                        LOGE("Failed to set in speed");
-                    if (cfsetospeed(&ios, B115200) != 0)
-                        LOGE("Failed to set out speed");
-                    tcsetattr(fd, TCSANOW, &ios);
-                }
+                fd = openTty(s_device_path);
             }
 
             if (fd < 0) {
@@ -3990,12 +4472,49 @@ mainLoop(void *param) {
         }
         sleep(1);
         s_closed = 0;
-        ret = at_open(fd, onUnsolicited);
+
+        /*
+         * with CMUX, commands, unsolicited responses and long running
+         * queries each get their own DLC, so none of them waits behind
+         * another on the tty
+         */
+        muxed = s_cmux && cmux_open(fd, sizeof(dlc) / sizeof(dlc[0]), dlc) == 0;
+
+        if (s_cmux && !muxed) {
+            LOGE("CMUX unavailable, using the tty directly\n");
+        }
+
+        ret = at_open(muxed ? dlc[0] : fd, onUnsolicited);
 
         if (ret < 0) {
             LOGE("AT error %d on at_open\n", ret);
             return 0;
         }
+
+        if (muxed
+            && (at_add_channel(dlc[1], AT_CHANNEL_UNSOLICITED) < 0
+                || at_add_channel(dlc[2], AT_CHANNEL_LONG) < 0)
+        ) {
+            LOGE("unable to add CMUX channels\n");
+        }
+
+        /*
+         * a second port for notifications; at_handshake() turns echo
+         * off on it and initializeCallback enables unsolicited responses
+         * on it so they never interleave with command responses
+         */
+        if (!muxed && s_notify_path != NULL) {
+            notifyFd = openTty(s_notify_path);
+
+            if (notifyFd < 0
+                || at_add_channel(notifyFd, AT_CHANNEL_UNSOLICITED) < 0
+            ) {
+                LOGE("unable to use notification port %s\n", s_notify_path);
+                if (notifyFd >= 0) {
+                    close(notifyFd);
+                }
+            }
+        }
         sleep(1);
 
         RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
@@ -4005,6 +4524,13 @@ mainLoop(void *param) {
         sleep(1);
 
         waitForClose();
+
+        if (muxed) {
+            /* at_close() has closed the DLCs, the tty is still ours */
+            cmux_close();
+            close(fd);
+        }
+
         LOGI("Re-opening after close");
     }
 }
@@ -4021,7 +4547,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 
     s_rilenv = env;
 
-    while (-1 != (opt = getopt(argc, argv, "p:d:s:"))) {
+    while (-1 != (opt = getopt(argc, argv, "p:d:s:n:amu:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -4043,6 +4569,26 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
                 LOGI("Opening socket %s\n", s_device_path);
                 break;
 
+            case 'n':
+                at_set_pipeline_depth(atoi(optarg));
+                LOGI("AT pipeline depth %s\n", optarg);
+                break;
+
+            case 'a':
+                at_set_adaptive_timeouts(1);
+                LOGI("Adaptive AT command timeouts\n");
+                break;
+
+            case 'm':
+                s_cmux = 1;
+                LOGI("Using CMUX\n");
+                break;
+
+            case 'u':
+                s_notify_path = optarg;
+                LOGI("Reading unsolicited responses from %s\n", s_notify_path);
+                break;
+
             default:
                 usage(argv[0]);
                 return NULL;
@@ -4067,7 +4613,7 @@ int main(int argc, char **argv) {
     int fd = -1;
     int opt;
 
-    while (-1 != (opt = getopt(argc, argv, "p:d:"))) {
+    while (-1 != (opt = getopt(argc, argv, "p:d:n:amu:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -4088,6 +4634,26 @@ int main(int argc, char **argv) {
                 LOGI("Opening socket %s\n", s_device_path);
                 break;
 
+            case 'n':
+                at_set_pipeline_depth(atoi(optarg));
+                LOGI("AT pipeline depth %s\n", optarg);
+                break;
+
+            case 'a':
+                at_set_adaptive_timeouts(1);
+                LOGI("Adaptive AT command timeouts\n");
+                break;
+
+            case 'm':
+                s_cmux = 1;
+                LOGI("Using CMUX\n");
+                break;
+
+            case 'u':
+                s_notify_path = optarg;
+                LOGI("Reading unsolicited responses from %s\n", s_notify_path);
+                break;
+
             default:
                 usage(argv[0]);
         }
@@ -0,0 +1,127 @@
+/* Infineon X-Gold RIL
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Drives at_cmux and atchannel on a tty the way the RIL does, against the
+ * modem simulated by cmux_sim.py, which starts it:
+ *
+ *   gcc -D_GNU_SOURCE -Itools/include -I. -o cmux_harness \
+ *       tools/cmux_harness.c at_cmux.c atchannel.c at_framer.c at_cmd.c \
+ *       at_tok.c misc.c -lpthread
+ *   python tools/cmux_sim.py ./cmux_harness
+ *
+ * DLC 3 is opened but never read, like a channel whose reader is stuck;
+ * the commands on DLC 1 must still be answered while the simulator floods
+ * it. returns 0 if every command got the expected response
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "atchannel.h"
+#include "at_cmux.h"
+
+static int s_unsolicitedCount = 0;
+
+static void onUnsolicited(const char *s, const char *sms_pdu)
+{
+    printf("unsolicited: %s\n", s);
+    s_unsolicitedCount++;
+}
+
+static int check(const char *command, int err, ATResponse *p_response,
+                    const char *expected)
+{
+    const char *line = NULL;
+
+    if (err == 0 && p_response != NULL
+        && p_response->p_intermediates != NULL
+    ) {
+        line = p_response->p_intermediates->line;
+    }
+
+    printf("%s: err %d success %d %s\n", command, err,
+            p_response != NULL ? p_response->success : -1,
+            line != NULL ? line : "-");
+
+    return err == 0 && p_response->success
+        && (expected == NULL || (line != NULL && 0 == strcmp(line, expected)))
+        ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct termios ios;
+    ATResponse *p_response = NULL;
+    int fds[3];
+    int fd, err, failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <tty>\n", argv[0]);
+        return 2;
+    }
+
+    fd = open(argv[1], O_RDWR);
+
+    if (fd < 0) {
+        perror("open");
+        return 2;
+    }
+
+    tcgetattr(fd, &ios);
+    cfmakeraw(&ios);
+    tcsetattr(fd, TCSANOW, &ios);
+
+    if (cmux_open(fd, 3, fds) < 0) {
+        printf("cmux_open failed\n");
+        return 1;
+    }
+
+    at_open(fds[0], onUnsolicited);
+    at_add_channel(fds[1], AT_CHANNEL_UNSOLICITED);
+    /* fds[2] is left unread */
+
+    err = at_send_command_numeric("AT+CGSN", &p_response);
+    failed |= check("AT+CGSN", err, p_response, "354321012345678");
+    at_response_free(p_response);
+    p_response = NULL;
+
+    err = at_send_command("AT+CREG=2", &p_response);
+    failed |= check("AT+CREG=2", err, p_response, NULL);
+    at_response_free(p_response);
+    p_response = NULL;
+
+    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+    failed |= check("AT+CSQ", err, p_response, "+CSQ: 20,99");
+    at_response_free(p_response);
+    p_response = NULL;
+
+    if (s_unsolicitedCount == 0) {
+        printf("no unsolicited response on DLC 2\n");
+        failed = 1;
+    }
+
+    at_close();
+    cmux_close();
+    close(fds[2]);
+    close(fd);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+
+    return failed ? 1 : 0;
+}
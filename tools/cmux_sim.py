@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+#
+# Infineon X-Gold RIL
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Simulates a modem in 3GPP TS 27.010 basic mode on a pty and runs the
+# program given on the command line (see cmux_harness.c) on its slave
+# side. Before answering the first command it floods DLC 3, which the
+# harness never reads, and checks that at_cmux asks it to stop sending
+# there with MSC flow control.
+#
+#   python tools/cmux_sim.py ./cmux_harness
+#
+
+import os
+import pty
+import select
+import subprocess
+import sys
+import time
+import tty
+
+FLAG = 0xF9
+SABM = 0x2F
+UA = 0x63
+UIH = 0xEF
+PF = 0x10
+
+FLOOD_DLC = 3
+FLOOD_BYTES = 512 * 1024
+TIMEOUT_SEC = 30
+
+CRC_TABLE = []
+for i in range(256):
+    c = i
+    for _ in range(8):
+        c = (c >> 1) ^ 0xE0 if c & 1 else c >> 1
+    CRC_TABLE.append(c)
+
+def crc8(data):
+    c = 0xFF
+    for b in bytearray(data):
+        c = CRC_TABLE[c ^ b]
+    return c
+
+def frame(dlci, control, info=b''):
+    # responses from the modem do not carry C/R
+    header = bytearray([(dlci << 2) | 1, control, (len(info) << 1) | 1])
+    return (bytearray([FLAG]) + header + bytearray(info)
+            + bytearray([0xFF - crc8(header), FLAG]))
+
+def responses(dlci, command):
+    """returns (dlci, data) pairs answering command sent on dlci"""
+    if command == b'AT+CGSN':
+        # an unsolicited response on the notification channel, and a
+        # response split over two frames
+        return [(2, b'\r\n+CREG: 1\r\n'),
+                (dlci, b'\r\n3543210'),
+                (dlci, b'12345678\r\n\r\nOK\r\n')]
+    elif command == b'AT+CSQ':
+        return [(dlci, b'\r\n+CSQ: 20,99\r\n\r\nOK\r\n')]
+    else:
+        return [(dlci, b'\r\nOK\r\n')]
+
+def main():
+    master, slave = pty.openpty()
+    tty.setraw(master)
+    tty.setraw(slave)
+
+    harness = subprocess.Popen(sys.argv[1:] + [os.ttyname(slave)])
+
+    rx = bytearray()
+    tx = bytearray()
+    dlcLines = {}
+    muxing = False
+    flooded = False
+    throttled = False
+    deadline = time.time() + TIMEOUT_SEC
+
+    while harness.poll() is None and time.time() < deadline:
+        readable, writable, _ = select.select(
+                [master], [master] if tx else [], [], 0.5)
+
+        if writable:
+            count = os.write(master, bytes(tx[:4096]))
+            del tx[:count]
+
+        if not readable:
+            continue
+
+        try:
+            rx += os.read(master, 4096)
+        except OSError:
+            break
+
+        if not muxing:
+            if b'AT+CMUX=0\r' in rx:
+                del rx[:]
+                tx += b'\r\nOK\r\n'
+                muxing = True
+            continue
+
+        while True:
+            start = rx.find(bytearray([FLAG]))
+            if start < 0:
+                del rx[:]
+                break
+            while start + 1 < len(rx) and rx[start + 1] == FLAG:
+                start += 1
+            del rx[:start]
+            if len(rx) < 6 or len(rx) < 6 + (rx[3] >> 1):
+                break
+
+            length = rx[3] >> 1
+            dlci = rx[1] >> 2
+            control = rx[2] & ~PF
+            info = bytes(rx[4:4 + length])
+            if CRC_TABLE[crc8(rx[1:4]) ^ rx[4 + length]] != 0xCF:
+                print('bad FCS')
+                return 1
+            # the closing flag may open the next frame
+            del rx[:5 + length]
+
+            if control == SABM:
+                tx += frame(dlci, UA | PF)
+            elif dlci == 0:
+                # MSC for DLC 3 with FC set
+                if info[:4] == bytearray([0xE3, 0x05, 0x0F, 0x8F]):
+                    throttled = True
+            elif control == UIH:
+                dlcLines[dlci] = dlcLines.get(dlci, b'') + info
+                while b'\r' in dlcLines[dlci]:
+                    command, _, dlcLines[dlci] = dlcLines[dlci].partition(b'\r')
+                    if not flooded:
+                        chunk = b'+XFLOOD: 0123456789012345678\r\n'
+                        for _ in range(FLOOD_BYTES // len(chunk)):
+                            tx += frame(FLOOD_DLC, UIH, chunk)
+                        flooded = True
+                    for toDlci, data in responses(dlci, command):
+                        tx += frame(toDlci, UIH, data)
+
+    if harness.poll() is None:
+        print('harness stuck')
+        harness.kill()
+        return 1
+
+    if not throttled:
+        print('no flow control on DLC %d' % FLOOD_DLC)
+        return 1
+
+    return harness.returncode
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,211 @@
+/* Infineon X-Gold RIL
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Microbenchmark for at_framer: feeds a stream of typical responses
+ * through a pipe in reads of fixed sizes, from single bytes to whole
+ * bursts, and splits it with at_framer_next_line(). The lines are checked
+ * against the stream, and since they are consumed as they come the ring
+ * wraps over and over, with lines straddling its end.
+ *
+ *   gcc -O2 -D_GNU_SOURCE -Itools/include -I. -o framer_bench \
+ *       tools/framer_bench.c at_framer.c -lpthread
+ *   ./framer_bench [megabytes]
+ *
+ * The time includes the write() and readv() of every fragment, as on a
+ * tty, so small fragments measure the system calls more than the scan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "at_framer.h"
+
+static const char *s_responses[] = {
+    "\r\nOK\r\n",
+    "\r\n+CSQ: 20,99\r\n\r\nOK\r\n",
+    "\r\n+CREG: 2,1,\"00C3\",\"0000F2A1\",2\r\n",
+    "\r\n+CLCC: 1,0,0,0,0,\"+15551234567\",145\r\n"
+        "+CLCC: 2,1,5,0,0,\"+15557654321\",145\r\n\r\nOK\r\n",
+    "\r\n+COPS: (2,\"Operator Long Name\",\"OpShort\",\"00101\",2),"
+        "(1,\"Other Network Name\",\"Other\",\"00102\",0),"
+        "(3,\"Third\",\"Thr\",\"00103\",2),,(0,1,2,3,4),(0,1,2)\r\n\r\nOK\r\n",
+    "\r\n+CME ERROR: 10\r\n",
+    "\r\n+CMT: ,23\r\n"
+        "07911326040000F0040B911346610089F60000208062917314080CC8329BFD06"
+        "5DDF72363904\r\n",
+};
+
+#define NUM_RESPONSES (sizeof(s_responses) / sizeof(s_responses[0]))
+
+static const size_t s_fragments[] = { 1, 7, 64, 512, 4096 };
+
+#define NUM_FRAGMENTS (sizeof(s_fragments) / sizeof(s_fragments[0]))
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** returns a stream of at least size bytes of responses, its length in *p_len */
+static char *makeStream(size_t size, size_t *p_len)
+{
+    char *stream;
+    size_t len = 0, n;
+    int i;
+
+    stream = malloc(size + 4096);
+
+    for (i = 0 ; len < size ; i++) {
+        n = strlen(s_responses[i % NUM_RESPONSES]);
+        memcpy(stream + len, s_responses[i % NUM_RESPONSES], n);
+        len += n;
+    }
+
+    *p_len = len;
+
+    return stream;
+}
+
+/**
+ * returns the complete lines of the stream run together, as
+ * at_framer_next_line() should hand them out: split at every run of
+ * '\r' and '\n'
+ */
+static char *expectedLines(const char *stream, size_t len, size_t *p_len,
+                            int *p_count)
+{
+    char *lines = malloc(len + 1);
+    size_t i, n = 0, lineStart = 0;
+    int count = 0;
+
+    for (i = 0 ; i < len ; i++) {
+        if (stream[i] != '\r' && stream[i] != '\n') {
+            lines[n++] = stream[i];
+        } else if (n > lineStart) {
+            count++;
+            lineStart = n;
+        }
+    }
+
+    /* a partial line at the end is not handed out */
+    *p_len = lineStart;
+    *p_count = count;
+
+    return lines;
+}
+
+/** returns 0 if the framer handed out exactly the expected lines */
+static int run(const char *stream, size_t len, size_t fragment,
+                const char *expected, size_t expectedLen, int expectedCount,
+                double *p_seconds)
+{
+    static ATFramer framer;
+    const char *line;
+    size_t sent, n, matched = 0;
+    int fds[2];
+    int count = 0, failed = 0;
+    double start;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    at_framer_init(&framer);
+    start = now();
+
+    for (sent = 0 ; sent < len ; sent += n) {
+        n = len - sent < fragment ? len - sent : fragment;
+
+        if (write(fds[1], stream + sent, n) != (ssize_t) n
+            || at_framer_read(&framer, fds[0]) != (int) n
+        ) {
+            perror("pipe");
+            failed = 1;
+            break;
+        }
+
+        while ((line = at_framer_next_line(&framer)) != NULL) {
+            size_t lineLen = strlen(line);
+
+            if (matched + lineLen > expectedLen
+                || 0 != memcmp(expected + matched, line, lineLen)
+            ) {
+                failed = 1;
+            }
+
+            matched += lineLen;
+            count++;
+        }
+    }
+
+    *p_seconds = now() - start;
+
+    close(fds[0]);
+    close(fds[1]);
+
+    if (failed || count != expectedCount || matched != expectedLen) {
+        printf("fragment %u: got %d lines, expected %d\n",
+                (unsigned) fragment, count, expectedCount);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *stream;
+    size_t len, i;
+    int failed = 0;
+    double seconds;
+
+    len = (argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+    stream = makeStream(len, &len);
+
+    for (i = 0 ; i < NUM_FRAGMENTS ; i++) {
+        /* single bytes are slow through a pipe; a sixteenth is enough */
+        size_t runLen = s_fragments[i] == 1 ? len / 16 : len;
+        size_t runExpectedLen;
+        int runCount;
+        char *runExpected;
+
+        runExpected = expectedLines(stream, runLen, &runExpectedLen,
+                                    &runCount);
+
+        if (run(stream, runLen, s_fragments[i], runExpected, runExpectedLen,
+                runCount, &seconds) < 0) {
+            failed = 1;
+        } else {
+            printf("fragment %4u: %9u bytes %7.1f MB/s %7.1f ns/line\n",
+                    (unsigned) s_fragments[i], (unsigned) runLen,
+                    runLen / seconds / 1e6, seconds / runCount * 1e9);
+        }
+
+        free(runExpected);
+    }
+
+    free(stream);
+
+    return failed ? 1 : 0;
+}
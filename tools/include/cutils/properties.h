@@ -0,0 +1,23 @@
+/* Infineon X-Gold RIL
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/* misc.c includes this but uses none of it; empty on the host */
+
+#ifndef TOOLS_CUTILS_PROPERTIES_H
+#define TOOLS_CUTILS_PROPERTIES_H 1
+
+#define PROPERTY_VALUE_MAX 92
+
+#endif /*TOOLS_CUTILS_PROPERTIES_H*/
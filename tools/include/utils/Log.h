@@ -0,0 +1,30 @@
+/* Infineon X-Gold RIL
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/* stands in for the Android log on the host, for the programs in tools/ */
+
+#ifndef TOOLS_UTILS_LOG_H
+#define TOOLS_UTILS_LOG_H 1
+
+#include <stdio.h>
+
+#define LOG_PRINT(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+
+#define LOGE LOG_PRINT
+#define LOGW LOG_PRINT
+#define LOGI LOG_PRINT
+#define LOGD LOG_PRINT
+
+#endif /*TOOLS_UTILS_LOG_H*/
@@ -0,0 +1,251 @@
+/* Infineon X-Gold RIL
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Microbenchmark for at_tok: times the delimiter and character scans
+ * behind at_tok_index(), at_tok_nextstr() and at_tok_charcounter() on
+ * short and long response lines, and at_tok_parseint() against strtol().
+ * Build it twice, the second time with the vector scans left out, and
+ * compare the two:
+ *
+ *   gcc -O2 -I. -o tok_bench tools/tok_bench.c at_tok.c
+ *   gcc -O2 -I. -DAT_TOK_SCALAR -o tok_bench_scalar \
+ *       tools/tok_bench.c at_tok.c
+ *   ./tok_bench && ./tok_bench_scalar
+ *
+ * Each run first checks at_tok_parseint() against strtol() and the
+ * tokenizers against each other, and fails if they disagree
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "at_tok.h"
+
+#define ROUNDS 2000000
+
+static const char *s_lines[] = {
+    "+CSQ: 20,99",
+    "+CREG: 2,1,\"00C3\",\"0000F2A1\",2",
+    "+CLCC: 1,0,0,0,0,\"+15551234567\",145",
+    "+COPS: (2,\"Operator Long Name\",\"OpShort\",\"00101\",2),"
+        "(1,\"Other Network Name\",\"Other\",\"00102\",0),"
+        "(3,\"Third\",\"Thr\",\"00103\",2),,(0,1,2,3,4),(0,1,2)",
+};
+
+#define NUM_LINES (sizeof(s_lines) / sizeof(s_lines[0]))
+
+static const char *s_numbers[] = {
+    "0", "7", "99", "145", " 12", "-1", "+42", "2147483647", "-2147483648",
+    "65535", "1234567",
+};
+
+#define NUM_NUMBERS (sizeof(s_numbers) / sizeof(s_numbers[0]))
+
+static const char *s_hexNumbers[] = {
+    "0", "C3", "00C3", "0000F2A1", "0x1F", "FFFFFFFF", "7fffffff",
+};
+
+#define NUM_HEX_NUMBERS (sizeof(s_hexNumbers) / sizeof(s_hexNumbers[0]))
+
+static volatile long s_sink;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** returns 0 if at_tok_parseint() agrees with strtol()/strtoul() */
+static int checkParseInt()
+{
+    unsigned int i;
+    int value;
+    long expected;
+
+    for (i = 0 ; i < NUM_NUMBERS ; i++) {
+        expected = strtol(s_numbers[i], NULL, 10);
+
+        if (at_tok_parseint(s_numbers[i], &value, 10) < 0
+            || value != expected
+        ) {
+            printf("at_tok_parseint(\"%s\", 10) disagrees with strtol()\n",
+                    s_numbers[i]);
+            return -1;
+        }
+    }
+
+    for (i = 0 ; i < NUM_HEX_NUMBERS ; i++) {
+        expected = (long) (unsigned int) strtoul(s_hexNumbers[i], NULL, 16);
+
+        if (at_tok_parseint(s_hexNumbers[i], &value, 16) < 0
+            || (unsigned int) value != (unsigned long) expected
+        ) {
+            printf("at_tok_parseint(\"%s\", 16) disagrees with strtoul()\n",
+                    s_hexNumbers[i]);
+            return -1;
+        }
+    }
+
+    if (at_tok_parseint("2147483648", &value, 10) == 0
+        || at_tok_parseint("100000000", &value, 16) == 0
+        || at_tok_parseint("", &value, 10) == 0
+    ) {
+        printf("at_tok_parseint() accepted an out of range value\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/** returns 0 if at_tok_index() splits every line like at_tok_nextstr() */
+static int checkIndex()
+{
+    char buf[512];
+    char field[256];
+    char *cur, *str;
+    ATTokIndex index;
+    unsigned int i;
+    int n;
+
+    for (i = 0 ; i < NUM_LINES ; i++) {
+        strcpy(buf, s_lines[i]);
+        cur = buf;
+
+        if (at_tok_index(s_lines[i], &index) < 0 || at_tok_start(&cur) < 0) {
+            return -1;
+        }
+
+        for (n = 0 ; at_tok_hasmore(&cur) ; n++) {
+            if (at_tok_nextstr(&cur, &str) < 0 || n >= index.count
+                || at_tok_fieldcopy(&index, n, field, sizeof(field)) < 0
+                || 0 != strcmp(field, str)
+            ) {
+                printf("at_tok_index() splits \"%s\" differently\n",
+                        s_lines[i]);
+                return -1;
+            }
+        }
+
+        if (n != index.count) {
+            printf("at_tok_index() found %d fields in \"%s\", not %d\n",
+                    index.count, s_lines[i], n);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void benchLines()
+{
+    char buf[512];
+    char *cur, *str;
+    ATTokIndex index;
+    unsigned int i;
+    int r, count;
+    double start, indexTime, nextTime, countTime;
+
+    for (i = 0 ; i < NUM_LINES ; i++) {
+        start = now();
+        for (r = 0 ; r < ROUNDS ; r++) {
+            at_tok_index(s_lines[i], &index);
+            s_sink += index.count;
+        }
+        indexTime = now() - start;
+
+        start = now();
+        for (r = 0 ; r < ROUNDS ; r++) {
+            strcpy(buf, s_lines[i]);
+            cur = buf;
+            at_tok_start(&cur);
+            while (at_tok_hasmore(&cur)) {
+                at_tok_nextstr(&cur, &str);
+                s_sink += str[0];
+            }
+        }
+        nextTime = now() - start;
+
+        start = now();
+        for (r = 0 ; r < ROUNDS ; r++) {
+            at_tok_charcounter((char *) s_lines[i], '(', &count);
+            s_sink += count;
+        }
+        countTime = now() - start;
+
+        printf("%3u bytes: index %6.1f ns  nextstr %6.1f ns"
+                "  charcounter %6.1f ns\n",
+                (unsigned) strlen(s_lines[i]),
+                indexTime / ROUNDS * 1e9, nextTime / ROUNDS * 1e9,
+                countTime / ROUNDS * 1e9);
+    }
+}
+
+static void benchParseInt(const char **numbers, unsigned int count,
+                            int base)
+{
+    unsigned int i;
+    int r, value;
+    double start, parseTime, strtolTime;
+
+    start = now();
+    for (r = 0 ; r < ROUNDS ; r++) {
+        for (i = 0 ; i < count ; i++) {
+            at_tok_parseint(numbers[i], &value, base);
+            s_sink += value;
+        }
+    }
+    parseTime = now() - start;
+
+    start = now();
+    for (r = 0 ; r < ROUNDS ; r++) {
+        for (i = 0 ; i < count ; i++) {
+            errno = 0;
+            s_sink += strtol(numbers[i], NULL, base);
+            s_sink += errno;
+        }
+    }
+    strtolTime = now() - start;
+
+    printf("base %2d: at_tok_parseint %5.1f ns  strtol %5.1f ns\n", base,
+            parseTime / ROUNDS / count * 1e9,
+            strtolTime / ROUNDS / count * 1e9);
+}
+
+int main()
+{
+    if (checkParseInt() < 0 || checkIndex() < 0) {
+        return 1;
+    }
+
+#if defined(AT_TOK_SCALAR)
+    printf("scalar scans\n");
+#else
+    printf("vector scans where the target has them\n");
+#endif
+
+    benchLines();
+    benchParseInt(s_numbers, NUM_NUMBERS, 10);
+    benchParseInt(s_hexNumbers, NUM_HEX_NUMBERS, 16);
+
+    return 0;
+}